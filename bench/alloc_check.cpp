@@ -0,0 +1,193 @@
+// Heap allocations per request on warmed up keep-alive connections, in every serving mode,
+// for small, large and streamed responses. Fails when a mode needs more than `limit` of them
+// per request on average.
+//
+// usage: alloc_check [requests per mode] [limit] [port]
+
+#include "http.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <netinet/in.h>
+
+static std::atomic<size_t> sAllocations{0};
+
+void* operator new(size_t size) {
+    sAllocations.fetch_add(1, std::memory_order_relaxed);
+
+    if (void* p = malloc(size ? size : 1))
+        return p;
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+static const char sGetRequest[] =
+    "GET /items/42/details HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=4f2a9c1e7b3d5a6f8e0c2b4d6f8a0c2e\r\n"
+    "\r\n";
+
+static const char sLargeRequest[] = "GET /large HTTP/1.1\r\nHost: localhost\r\n\r\n";
+static const char sStreamRequest[] = "GET /stream HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+// above what is copied next to the head, so the body is moved into the output queue
+static const std::string sLargeBody(16 * 1024, 'x');
+
+static const char sPostRequest[] =
+    "POST /echo HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 40\r\n"
+    "\r\n"
+    "0123456789012345678901234567890123456789";
+
+class Client {
+    int mSocket;
+    char mBuffer[64 * 1024];
+
+    public:
+        explicit Client(uint16_t port) {
+            mSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+            struct sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+            if (mSocket < 0 || connect(mSocket, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0)
+                throw std::runtime_error("could not connect to the server");
+        }
+
+        ~Client() { ::close(mSocket); }
+
+        // reads until the whole response is in the buffer, it's never larger than that
+        void request(const char* data, size_t size) {
+            if (::send(mSocket, data, size, MSG_NOSIGNAL) != static_cast<ssize_t>(size))
+                throw std::runtime_error("send failed");
+
+            size_t received = 0;
+            while (!complete({mBuffer, received})) {
+                ssize_t n = recv(mSocket, mBuffer + received, sizeof(mBuffer) - received, 0);
+                if (n <= 0)
+                    throw std::runtime_error("connection closed");
+
+                received += n;
+            }
+
+            if (memcmp(mBuffer, "HTTP/1.1 200", 12) != 0)
+                throw std::runtime_error("no 200 response");
+        }
+
+        static bool complete(std::string_view response) {
+            size_t headEnd = response.find("\r\n\r\n");
+            if (headEnd == std::string_view::npos)
+                return false;
+
+            std::string_view head = response.substr(0, headEnd);
+            if (head.find("Transfer-Encoding: chunked") != std::string_view::npos)
+                return response.size() >= 5 && response.substr(response.size() - 5) == "0\r\n\r\n";
+
+            size_t lengthAt = head.find("Content-Length: ");
+            size_t length = lengthAt == std::string_view::npos ? 0 : strtoull(head.data() + lengthAt + 16, nullptr, 10);
+            return response.size() >= headEnd + 4 + length;
+        }
+
+        void requestAll() {
+            request(sGetRequest, sizeof(sGetRequest) - 1);
+            request(sPostRequest, sizeof(sPostRequest) - 1);
+            request(sLargeRequest, sizeof(sLargeRequest) - 1);
+            request(sStreamRequest, sizeof(sStreamRequest) - 1);
+        }
+};
+
+// allocations per request of the whole process while `requests` are served
+static double measure(uint16_t port, size_t requests) {
+    Client client{port};
+
+    // buffers and thread locals grow on the first requests
+    for (int i = 0; i < 100; i++)
+        client.requestAll();
+
+    size_t before = sAllocations.load();
+    for (size_t i = 0; i < requests / 4; i++)
+        client.requestAll();
+
+    return double(sAllocations.load() - before) / (requests / 4 * 4);
+}
+
+int main(int argc, char** argv) {
+    size_t requests = argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000;
+    double limit = argc > 2 ? atof(argv[2]) : 0.5;
+    uint16_t port = argc > 3 ? atoi(argv[3]) : 18490;
+
+    struct Mode {
+        const char* name;
+        std::function<void(HttpServer&)> setup;
+    };
+
+    std::vector<Mode> modes = {
+        { "thread per connection", [](HttpServer&) {} },
+        { "worker pool", [](HttpServer& s) { s.setWorkerPool(2, 16); } },
+        #ifdef TINYHTTP_EPOLL
+        { "event loop", [](HttpServer& s) { s.setEventLoopCount(1); } },
+        #endif
+    };
+
+    bool ok = true;
+
+    for (auto& mode : modes) {
+        HttpServer server;
+        mode.setup(server);
+
+        server.when("/items/:id<int>/details")->requested([](const HttpRequest& req, HttpResponse& res) {
+            res.setContent("text/plain", req.param("id"));
+        });
+
+        server.when("/echo")->posted([](const HttpRequest& req, HttpResponse& res) {
+            res.setContent("text/plain", req.content());
+        });
+
+        server.when("/large")->requested([](const HttpRequest&, HttpResponse& res) {
+            res.setContent("text/plain", sLargeBody);
+        });
+
+        // three 1 kB chunks, the counter fits into the producer without an allocation
+        server.when("/stream")->requested([](const HttpRequest&, HttpResponse& res) {
+            res[HttpHeader::ContentType] = "text/plain";
+            res.setProducer([sent = 0](void* buffer, size_t max) mutable -> size_t {
+                if (sent++ == 3)
+                    return 0;
+
+                size_t n = std::min<size_t>(max, 1024);
+                memset(buffer, 'y', n);
+                return n;
+            });
+        });
+
+        std::thread listener{[&]() { server.startListening(port); }};
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        double perRequest = measure(port, requests);
+        bool passed = perRequest <= limit;
+        ok = ok && passed;
+
+        server.shutdown();
+        listener.join();
+
+        printf("%-22s %6.2f allocations per request  %s\n", mode.name, perRequest, passed ? "ok" : "FAILED");
+        fflush(stdout);
+
+        // the next mode listens on a port of its own, the last one may linger in TIME_WAIT
+        port++;
+    }
+
+    return ok ? 0 : 1;
+}
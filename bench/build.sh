@@ -0,0 +1,15 @@
+#!/bin/bash
+
+initialwd=$PWD
+
+if [ ! -d ../examples/MiniJson ]; then
+    cd ../examples
+    git clone https://github.com/zsmj2017/MiniJson
+    cd MiniJson
+    cmake .
+    make -j
+    cd $initialwd
+fi
+
+mkdir -p build
+make
@@ -0,0 +1,161 @@
+// Opens a large number of keep-alive connections to an event loop server in a child process,
+// makes a request on each as it opens, then another on every one once all of them are open.
+// Fails unless every request is answered. Each side needs a descriptor per connection, so the
+// hard RLIMIT_NOFILE has to allow them.
+//
+// usage: conn_stress [connections] [event loops] [port]
+
+#include "http.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// each source address has its own range of ephemeral ports, so they are taken in turn
+static constexpr size_t sConnectionsPerSource = 20000;
+
+static size_t raiseFileLimit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+        return 0;
+
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    return limit.rlim_cur;
+}
+
+static int connectFrom(size_t index, uint16_t port) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+
+    // the port is picked at connect time, binding one up front searches the port range each time
+    int one = 1;
+    setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+
+    struct sockaddr_in source = {};
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + index / sConnectionsPerSource);
+
+    struct sockaddr_in server = {};
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(sock, reinterpret_cast<struct sockaddr*>(&source), sizeof(source)) < 0
+        || connect(sock, reinterpret_cast<struct sockaddr*>(&server), sizeof(server)) < 0) {
+        ::close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static bool answered(int sock) {
+    static const char request[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    char buffer[256];
+
+    if (::send(sock, request, sizeof(request) - 1, MSG_NOSIGNAL) != sizeof(request) - 1)
+        return false;
+
+    ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+    return n >= 12 && memcmp(buffer, "HTTP/1.1 200", 12) == 0;
+}
+
+static void runServer(unsigned loops, uint16_t port) {
+    HttpServer server;
+    server.setEventLoopCount(loops);
+    server.setListenBacklog(65535);
+
+    // opening them takes longer than the default idle timeout
+    server.setKeepAlive(0, 0);
+
+    server.when("/")->requested([](const HttpRequest&) {
+        return HttpResponse{200, "text/plain", "ok"};
+    });
+
+    server.when("/shutdown")->requested([&server](const HttpRequest&) {
+        server.shutdown();
+        return HttpResponse{200, "text/plain", "bye"};
+    });
+
+    server.startListening(port);
+}
+
+int main(int argc, char** argv) {
+    size_t connections = argc > 1 ? strtoull(argv[1], nullptr, 10) : 100000;
+    unsigned loops = argc > 2 ? atoi(argv[2]) : 4;
+    uint16_t port = argc > 3 ? atoi(argv[3]) : 18500;
+
+    size_t limit = raiseFileLimit();
+    if (limit < connections + 64) {
+        fprintf(stderr, "the open file limit is %zu, only %zu connections are opened (raise the hard limit for more)\n",
+            limit, limit - 64);
+        connections = limit - 64;
+    }
+
+    pid_t child = fork();
+    if (child == 0) {
+        // the access log of every request would only slow the server down
+        freopen("/dev/null", "w", stdout);
+        runServer(loops, port);
+        _exit(0);
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<int> sockets;
+    sockets.reserve(connections);
+
+    for (size_t i = 0; i < connections; i++) {
+        int sock = connectFrom(i, port);
+        if (sock < 0) {
+            perror("connect");
+            break;
+        }
+
+        sockets.push_back(sock);
+
+        if (!answered(sock)) {
+            fprintf(stderr, "connection %zu got no answer\n", i);
+            break;
+        }
+    }
+
+    std::chrono::duration<double> connected = std::chrono::steady_clock::now() - start;
+    printf("%zu connections open in %.1f s, highest client fd %d\n", sockets.size(), connected.count(),
+        sockets.empty() ? -1 : sockets.back());
+    fflush(stdout);
+
+    size_t ok = 0;
+    for (int sock : sockets)
+        ok += answered(sock);
+
+    std::chrono::duration<double> total = std::chrono::steady_clock::now() - start;
+    printf("%zu of them answered again, %.1f s in total\n", ok, total.count());
+
+    for (int sock : sockets)
+        ::close(sock);
+
+    int control = connectFrom(0, port);
+    if (control >= 0) {
+        static const char request[] = "GET /shutdown HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        if (::send(control, request, sizeof(request) - 1, MSG_NOSIGNAL) < 0)
+            perror("send");
+
+        ::close(control);
+    }
+    else
+        kill(child, SIGTERM);
+
+    int status;
+    waitpid(child, &status, 0);
+
+    return ok == connections ? 0 : 1;
+}
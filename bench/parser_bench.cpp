@@ -0,0 +1,190 @@
+// Request head parsing: the line based parser tinyhttp used before against HttpRequestParser
+//
+// usage: parser_bench [iterations]
+
+#include "http.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <sstream>
+#include <vector>
+
+static const std::string sBrowserRequest =
+    "GET /static/app/main.js?v=20240517 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9,hu;q=0.8\r\n"
+    "Cookie: session=4f2a9c1e7b3d5a6f8e0c2b4d6f8a0c2e; theme=dark\r\n"
+    "If-None-Match: \"5f3c-18f2a1b3c40\"\r\n"
+    "\r\n";
+
+static const std::string sCurlRequest =
+    "GET /api/items/42 HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+// The parser before HttpRequestParser, reading from memory instead of a socket: byte by byte
+// line reads, an istringstream for the request line and a map of lowercased copies for the
+// headers. Printing every request is left out, it would dominate the time.
+struct LegacyRequest {
+    std::string method, path, query;
+    std::map<std::string, std::string> headers;
+
+    std::string& operator[](std::string name) {
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+
+        auto f = headers.find(name);
+        if (f == headers.end()) {
+            if (headers.size() >= MAX_HTTP_HEADERS)
+                throw std::runtime_error("too many HTTP headers");
+
+            headers.insert(std::pair<std::string, std::string>(name, ""));
+        }
+
+        return headers.find(name)->second;
+    }
+};
+
+static std::string legacyReceiveLine(const char*& p, const char* end) {
+    std::string res;
+
+    while (p < end) {
+        char ch = *p++;
+
+        if (ch == '\r') continue;
+        if (ch == '\n') break;
+
+        if (!isascii(ch))
+            throw std::runtime_error("Only ASCII characters were allowed");
+
+        res.push_back(ch);
+    }
+
+    return res;
+}
+
+static bool legacyParse(const std::string& head, LegacyRequest& req) {
+    const char* p = head.data();
+    const char* end = p + head.size();
+
+    std::istringstream iss(legacyReceiveLine(p, end));
+    std::vector<std::string> results(std::istream_iterator<std::string>{iss}, std::istream_iterator<std::string>());
+
+    if (results.size() < 2)
+        return false;
+
+    req.method = results[0];
+    req.path = results[1];
+
+    size_t question = req.path.find("?");
+    if (question != std::string::npos) {
+        req.query = req.path.substr(question);
+        req.path = req.path.substr(0, question);
+    }
+
+    while (true) {
+        std::string line = legacyReceiveLine(p, end);
+
+        if (line.empty()) break;
+
+        size_t sep = line.find(": ");
+        if (sep == std::string::npos || sep == 0)
+            return false;
+
+        std::string key = line.substr(0, sep), val = line.substr(sep+2);
+        req[key] = val;
+    }
+
+    return true;
+}
+
+template<typename F>
+static double nsPerRequest(size_t iterations, F&& parseOne) {
+    // warm up caches and the allocator first
+    for (size_t i = 0; i < iterations / 10 + 1; i++)
+        parseOne();
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++)
+        parseOne();
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+static size_t sSink = 0; // keeps the results alive
+
+static void run(const char* name, const std::string& head, size_t iterations) {
+    double legacy = nsPerRequest(iterations, [&]() {
+        LegacyRequest req;
+        if (!legacyParse(head, req))
+            abort();
+
+        sSink += req.headers.size() + req["host"].size();
+    });
+
+    // the parser alone: offsets into the buffer, nothing is copied
+    double inPlace = nsPerRequest(iterations, [&]() {
+        HttpRequestParser parser;
+        if (parser.parse(head.data(), head.size()) != HttpRequestParser::Status::Complete)
+            abort();
+
+        sSink += parser.headerCount();
+    });
+
+    // the same head arriving in 64 byte reads, as the event loop sees a slow client
+    double incremental = nsPerRequest(iterations, [&]() {
+        HttpRequestParser parser;
+        auto status = HttpRequestParser::Status::Incomplete;
+
+        for (size_t size = 64; status == HttpRequestParser::Status::Incomplete; size += 64)
+            status = parser.parse(head.data(), std::min(size, head.size()));
+
+        if (status != HttpRequestParser::Status::Complete)
+            abort();
+
+        sSink += parser.headerCount();
+    });
+
+    // what a connection does per request: parse into the request object it reuses
+    HttpRequest req;
+
+    double request = nsPerRequest(iterations, [&]() {
+        HttpRequestParser parser;
+        if (parser.parse(head.data(), head.size()) != HttpRequestParser::Status::Complete || !req.parse(parser, head.data()))
+            abort();
+
+        sSink += req.header(HttpHeader::Host).size();
+    });
+
+    printf("%s request (%zu bytes):\n", name, head.size());
+    printf("  legacy line parser        %8.1f ns\n", legacy);
+    printf("  HttpRequestParser         %8.1f ns  %5.1fx\n", inPlace, legacy / inPlace);
+    printf("  HttpRequestParser, 64 B   %8.1f ns  %5.1fx\n", incremental, legacy / incremental);
+    printf("  into a reused HttpRequest %8.1f ns  %5.1fx\n", request, legacy / request);
+}
+
+int main(int argc, char** argv) {
+    size_t iterations = argc > 1 ? strtoull(argv[1], nullptr, 10) : 500000;
+
+    printf("scanning with %s, %zu iterations\n\n", httpscan::implementation(), iterations);
+    run("browser", sBrowserRequest, iterations);
+    run("curl", sCurlRequest, iterations);
+
+    return sSink == 0;
+}
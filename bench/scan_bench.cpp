@@ -0,0 +1,121 @@
+// The byte scanning kernels of the parser, scalar against SSE4.2 and AVX2
+//
+// usage: scan_bench [iterations]
+
+// the kernels are internal to http.cpp, so it is built into the benchmark
+#include "../http.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+static const std::string sShortCookie = "session=4f2a9c1e7b3d5a6f8e0c2b4d6f8a0c2e; theme=dark";
+
+static std::string browserHead(const std::string& cookie) {
+    return
+        "GET /static/app/main.js?v=20240517 HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Connection: keep-alive\r\n"
+        "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+        "sec-ch-ua-mobile: ?0\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+        "sec-ch-ua-platform: \"Linux\"\r\n"
+        "Accept: */*\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Dest: script\r\n"
+        "Referer: https://www.example.com/\r\n"
+        "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+        "Accept-Language: en-US,en;q=0.9,hu;q=0.8\r\n"
+        "Cookie: " + cookie + "\r\n"
+        "If-None-Match: \"5f3c-18f2a1b3c40\"\r\n"
+        "\r\n";
+}
+
+struct Kernels {
+    const char* name;
+    const char* (*find)(const char*, size_t, char) noexcept;
+    bool (*isAscii)(const char*, size_t) noexcept;
+    bool (*isToken)(const char*, size_t) noexcept;
+};
+
+// The work the parser does on a head: find every line end, check the line is ASCII,
+// find the colon of headers and check their names are tokens
+static size_t scanHead(const Kernels& k, const std::string& head) {
+    const char* p = head.data();
+    const char* end = p + head.size();
+    size_t found = 0;
+
+    while (p < end) {
+        const char* nl = k.find(p, end - p, '\n');
+        if (!nl)
+            break;
+
+        size_t length = nl - p;
+        if (k.isAscii(p, length))
+            found++;
+
+        if (const char* colon = k.find(p, length, ':'); colon && k.isToken(p, colon - p))
+            found++;
+
+        p = nl + 1;
+    }
+
+    return found;
+}
+
+static size_t sSink = 0; // keeps the results alive
+
+static double nsPerHead(const Kernels& k, const std::string& head, size_t iterations) {
+    for (size_t i = 0; i < iterations / 10 + 1; i++)
+        sSink += scanHead(k, head);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++)
+        sSink += scanHead(k, head);
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+static void run(const char* name, const std::string& head, const std::vector<Kernels>& kernels, size_t iterations) {
+    printf("%s (%zu bytes):\n", name, head.size());
+
+    double scalar = 0;
+    for (auto& k : kernels) {
+        double ns = nsPerHead(k, head, iterations);
+        if (scalar == 0)
+            scalar = ns;
+
+        printf("  %-7s %8.1f ns  %6.2f GB/s  %5.2fx\n", k.name, ns, head.size() / ns, scalar / ns);
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t iterations = argc > 1 ? strtoull(argv[1], nullptr, 10) : 500000;
+
+    // the scalar find is memchr, which the C library vectorizes on its own
+    std::vector<Kernels> kernels{{ "scalar", httpscan::findScalar, httpscan::isAsciiScalar, httpscan::isTokenScalar }};
+
+    #ifdef TINYHTTP_SIMD_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse4.2"))
+        kernels.push_back({ "sse4.2", httpscan::findSse42, httpscan::isAsciiSse42, httpscan::isTokenSse42 });
+
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back({ "avx2", httpscan::findAvx2, httpscan::isAsciiAvx2, httpscan::isTokenAvx2 });
+    #endif
+
+    printf("the parser uses %s, %zu iterations\n\n", httpscan::implementation(), iterations);
+    run("browser head", browserHead(sShortCookie), kernels, iterations);
+
+    // tracking cookies make heads of several kilobytes
+    std::string longCookie;
+    while (longCookie.size() < 4000)
+        longCookie += "_ga_" + std::to_string(longCookie.size()) + "=GS1.1.1715939341.12.1.1715940012.0.0.0; ";
+
+    run("browser head with a 4 kB cookie", browserHead(longCookie), kernels, iterations / 4);
+
+    return sSink == 0;
+}
@@ -0,0 +1,173 @@
+// Static file throughput over loopback, 1 MiB to 1 GiB files served with sendfile by
+// serveFromFolder, against reading them into the response like tinyhttp did before
+//
+// usage: sendfile_bench [largest file in MiB] [directory for the files] [port]
+
+#include "http.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <netinet/in.h>
+#include <sys/stat.h>
+
+// files above this aren't read into memory, the comparison would only measure swapping
+static constexpr size_t sMaxBufferedSize = 128 << 20;
+
+static size_t peakRssKiB() {
+    std::ifstream status{"/proc/self/status"};
+    std::string line;
+
+    while (std::getline(status, line))
+        if (line.rfind("VmHWM:", 0) == 0)
+            return strtoull(line.c_str() + 6, nullptr, 10);
+
+    return 0;
+}
+
+// the files are kept between runs, writing a gigabyte takes a while
+static void createFile(const std::string& path, size_t size) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && static_cast<size_t>(st.st_size) == size)
+        return;
+
+    std::ofstream out{path, std::ios::binary | std::ios::trunc};
+    std::string block(1 << 20, '\0');
+    for (size_t i = 0; i < block.size(); i++)
+        block[i] = 'a' + i % 26;
+
+    for (size_t written = 0; written < size; written += block.size())
+        out.write(block.data(), std::min(block.size(), size - written));
+
+    if (!out)
+        throw std::runtime_error("could not write " + path);
+}
+
+class Client {
+    int mSocket;
+    std::unique_ptr<char[]> mBuffer{new char[1 << 20]};
+
+    public:
+        explicit Client(uint16_t port) {
+            mSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+            struct sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+            if (mSocket < 0 || connect(mSocket, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0)
+                throw std::runtime_error("could not connect to the server");
+        }
+
+        ~Client() { ::close(mSocket); }
+
+        // downloads `path` on the keep-alive connection, returns the length of the body
+        size_t get(const std::string& path) {
+            std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+            if (::send(mSocket, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size()))
+                throw std::runtime_error("send failed");
+
+            std::string head;
+            size_t headEnd;
+
+            while ((headEnd = head.find("\r\n\r\n")) == std::string::npos) {
+                ssize_t n = recv(mSocket, mBuffer.get(), 4096, 0);
+                if (n <= 0)
+                    throw std::runtime_error("connection closed in the head");
+
+                head.append(mBuffer.get(), n);
+            }
+
+            if (head.compare(0, 12, "HTTP/1.1 200") != 0)
+                throw std::runtime_error("unexpected response: " + head.substr(0, head.find('\r')));
+
+            size_t lengthAt = head.find("Content-Length: ");
+            if (lengthAt == std::string::npos)
+                throw std::runtime_error("response without a length");
+
+            size_t length = strtoull(head.c_str() + lengthAt + 16, nullptr, 10);
+            size_t received = head.size() - headEnd - 4;
+
+            while (received < length) {
+                ssize_t n = recv(mSocket, mBuffer.get(), std::min<size_t>(1 << 20, length - received), 0);
+                if (n <= 0)
+                    throw std::runtime_error("connection closed in the body");
+
+                received += n;
+            }
+
+            return length;
+        }
+};
+
+// MiB/s downloading `path` at least 3 times and at least 2 GiB worth
+static double throughput(Client& client, const std::string& path, size_t size) {
+    client.get(path);
+
+    size_t rounds = std::max<size_t>(3, (size_t{2} << 30) / size);
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < rounds; i++)
+        client.get(path);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return rounds * size / elapsed.count() / (1 << 20);
+}
+
+int main(int argc, char** argv) {
+    size_t maxSize = (argc > 1 ? strtoull(argv[1], nullptr, 10) : 1024) << 20;
+    std::string dir = argc > 2 ? argv[2] : "/tmp/tinyhttp_sendfile_bench";
+    uint16_t port = argc > 3 ? atoi(argv[3]) : 18480;
+
+    mkdir(dir.c_str(), 0755);
+
+    std::vector<size_t> sizes;
+    for (size_t size = 1 << 20; size <= maxSize; size *= 4)
+        sizes.push_back(size);
+
+    for (size_t size : sizes)
+        createFile(dir + "/" + std::to_string(size >> 20) + "M.bin", size);
+
+    HttpServer server;
+    server.whenMatching("/sendfile/[^/]+")->serveFromFolder(dir);
+
+    // the former serveFromFolder: the whole file read into a string and copied into the response
+    server.whenMatching("/buffered/[^/]+")->requested([&dir](const HttpRequest& req) {
+        std::string path = dir + req.getPath().substr(req.getPath().rfind('/'));
+        std::ifstream f{path, std::ios::binary};
+        std::string content{std::istreambuf_iterator<char>{f}, std::istreambuf_iterator<char>{}};
+        return HttpResponse{200, "application/octet-stream", content};
+    });
+
+    std::thread listener{[&]() { server.startListening(port); }};
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    {
+        Client client{port};
+
+        // the peak only grows, so every sendfile run comes before the buffered ones
+        printf("%10s %12s %10s\n", "sendfile", "MiB/s", "peak RSS");
+
+        for (size_t size : sizes) {
+            double rate = throughput(client, "/sendfile/" + std::to_string(size >> 20) + "M.bin", size);
+            printf("%8zu M %12.0f %6zu MiB\n", size >> 20, rate, peakRssKiB() >> 10);
+            fflush(stdout);
+        }
+
+        printf("\n%10s %12s %10s\n", "buffered", "MiB/s", "peak RSS");
+
+        for (size_t size : sizes) {
+            if (size > sMaxBufferedSize)
+                break;
+
+            double rate = throughput(client, "/buffered/" + std::to_string(size >> 20) + "M.bin", size);
+            printf("%8zu M %12.0f %6zu MiB\n", size >> 20, rate, peakRssKiB() >> 10);
+            fflush(stdout);
+        }
+    }
+
+    server.shutdown();
+    listener.join();
+    return 0;
+}
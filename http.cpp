@@ -3,339 +3,4045 @@
 
 #include <vector>
 #include <iterator>
+#include <algorithm>
+#include <charconv>
+#include <cstdarg>
+#include <random>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <poll.h>
 
-/*static*/ TCPClientStream TCPClientStream::acceptFrom(short listener) {
-    struct sockaddr_in client;
-    const size_t clientLen = sizeof(client);
+#if defined(TINYHTTP_SIMD) && (defined(__x86_64__) || defined(__i386__))
+#  include <immintrin.h>
+#  define TINYHTTP_SIMD_X86
+#endif
+
+#if defined(TINYHTTP_EPOLL) || defined(TINYHTTP_THREADING)
+#  include <sys/epoll.h>
+#endif
+
+#ifdef TINYHTTP_EPOLL
+#  include <sched.h>
+#  include <pthread.h>
+#endif
+
+namespace httpscan {
+    static constexpr bool isTokenChar(unsigned char ch) noexcept {
+        return (ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')
+            || ch == '!' || ch == '#' || ch == '$' || ch == '%' || ch == '&' || ch == '\'' || ch == '*'
+            || ch == '+' || ch == '-' || ch == '.' || ch == '^' || ch == '_' || ch == '`' || ch == '|' || ch == '~';
+    }
+
+    static const char* findScalar(const char* data, size_t size, char ch) noexcept {
+        return reinterpret_cast<const char*>(memchr(data, ch, size));
+    }
+
+    static bool isAsciiScalar(const char* data, size_t size) noexcept {
+        size_t i = 0;
+
+        for (uint64_t word; i + 8 <= size; i += 8) {
+            memcpy(&word, data + i, 8);
+            if (word & 0x8080808080808080ull)
+                return false;
+        }
+
+        for (; i < size; i++)
+            if (data[i] & 0x80)
+                return false;
+
+        return true;
+    }
+
+    static bool isTokenScalar(const char* data, size_t size) noexcept {
+        for (size_t i = 0; i < size; i++)
+            if (!isTokenChar(data[i]))
+                return false;
+
+        return size > 0;
+    }
+
+    #ifdef TINYHTTP_SIMD_X86
+    // Token characters as a bitmap split by nibbles: bit `hi` of sTokenLow[lo] is set
+    // if (hi << 4 | lo) is a token character. Two shuffles classify 16 bytes at once.
+    struct NibbleTable {
+        uint8_t low[16] = {}, high[16] = {};
+
+        constexpr NibbleTable() {
+            for (unsigned ch = 0; ch < 128; ch++)
+                if (isTokenChar(ch))
+                    low[ch & 0xF] |= 1 << (ch >> 4);
+
+            // bytes >= 0x80 map to 0 and never match
+            for (unsigned hi = 0; hi < 8; hi++)
+                high[hi] = 1 << hi;
+        }
+    };
+
+    alignas(16) static constexpr NibbleTable sTokenTable{};
+
+    __attribute__((target("sse4.2")))
+    static const char* findSse42(const char* data, size_t size, char ch) noexcept {
+        const __m128i needle = _mm_set1_epi8(ch);
+        size_t i = 0;
+
+        for (; i + 16 <= size; i += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+
+            if (mask)
+                return data + i + __builtin_ctz(mask);
+        }
+
+        return findScalar(data + i, size - i, ch);
+    }
+
+    __attribute__((target("sse4.2")))
+    static bool isAsciiSse42(const char* data, size_t size) noexcept {
+        __m128i acc = _mm_setzero_si128();
+        size_t i = 0;
+
+        for (; i + 16 <= size; i += 16)
+            acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)));
+
+        return _mm_movemask_epi8(acc) == 0 && isAsciiScalar(data + i, size - i);
+    }
+
+    __attribute__((target("sse4.2")))
+    static bool isTokenSse42(const char* data, size_t size) noexcept {
+        const __m128i low = _mm_load_si128(reinterpret_cast<const __m128i*>(sTokenTable.low));
+        const __m128i high = _mm_load_si128(reinterpret_cast<const __m128i*>(sTokenTable.high));
+        const __m128i nibble = _mm_set1_epi8(0x0F);
+        size_t i = 0;
+
+        for (; i + 16 <= size; i += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            __m128i lo = _mm_shuffle_epi8(low, _mm_and_si128(chunk, nibble));
+            __m128i hi = _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi16(chunk, 4), nibble));
+            __m128i invalid = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+
+            if (_mm_movemask_epi8(invalid))
+                return false;
+        }
+
+        return i == size ? size > 0 : isTokenScalar(data + i, size - i);
+    }
+
+    __attribute__((target("avx2")))
+    static const char* findAvx2(const char* data, size_t size, char ch) noexcept {
+        const __m256i needle = _mm256_set1_epi8(ch);
+        size_t i = 0;
+
+        for (; i + 32 <= size; i += 32) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+
+            if (mask)
+                return data + i + __builtin_ctz(mask);
+        }
+
+        // the SSE tail runs slowly with dirty upper halves, and tail calls don't always get a vzeroupper
+        _mm256_zeroupper();
+        return findSse42(data + i, size - i, ch);
+    }
+
+    __attribute__((target("avx2")))
+    static bool isAsciiAvx2(const char* data, size_t size) noexcept {
+        __m256i acc = _mm256_setzero_si256();
+        size_t i = 0;
+
+        for (; i + 32 <= size; i += 32)
+            acc = _mm256_or_si256(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i)));
+
+        if (_mm256_movemask_epi8(acc) != 0)
+            return false;
+
+        _mm256_zeroupper();
+        return isAsciiSse42(data + i, size - i);
+    }
+
+    __attribute__((target("avx2")))
+    static bool isTokenAvx2(const char* data, size_t size) noexcept {
+        // shuffles work within 128 bit lanes, so both lanes get the same table
+        const __m256i low = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(sTokenTable.low)));
+        const __m256i high = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(sTokenTable.high)));
+        const __m256i nibble = _mm256_set1_epi8(0x0F);
+        size_t i = 0;
+
+        for (; i + 32 <= size; i += 32) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            __m256i lo = _mm256_shuffle_epi8(low, _mm256_and_si256(chunk, nibble));
+            __m256i hi = _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), nibble));
+            __m256i invalid = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+
+            if (_mm256_movemask_epi8(invalid))
+                return false;
+        }
+
+        if (i == size)
+            return size > 0;
+
+        _mm256_zeroupper();
+        return isTokenSse42(data + i, size - i);
+    }
+    #endif
+
+    struct Implementation {
+        const char* (*find)(const char*, size_t, char) noexcept;
+        bool (*isAscii)(const char*, size_t) noexcept;
+        bool (*isToken)(const char*, size_t) noexcept;
+        const char* name;
+    };
+
+    static Implementation selectImplementation() noexcept {
+        #ifdef TINYHTTP_SIMD_X86
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx2"))
+            return { findAvx2, isAsciiAvx2, isTokenAvx2, "avx2" };
+
+        if (__builtin_cpu_supports("sse4.2"))
+            return { findSse42, isAsciiSse42, isTokenSse42, "sse4.2" };
+        #endif
 
-    short sock = accept(
-        listener,
-        reinterpret_cast<struct sockaddr*>(&client),
-        const_cast<socklen_t*>(reinterpret_cast<const socklen_t*>(&clientLen))
-    );
+        return { findScalar, isAsciiScalar, isTokenScalar, "scalar" };
+    }
+
+    // function local so it's safe to use from other static initializers
+    static const Implementation& selected() noexcept {
+        static const Implementation impl = selectImplementation();
+        return impl;
+    }
+
+    const char* find(const char* data, size_t size, char ch) noexcept {
+        // short inputs are not worth the indirect call
+        return size < 16 ? findScalar(data, size, ch) : selected().find(data, size, ch);
+    }
+
+    bool isAscii(const char* data, size_t size) noexcept {
+        return size < 16 ? isAsciiScalar(data, size) : selected().isAscii(data, size);
+    }
+
+    bool isToken(const char* data, size_t size) noexcept {
+        return size < 16 ? isTokenScalar(data, size) : selected().isToken(data, size);
+    }
+
+    const char* implementation() noexcept {
+        return selected().name;
+    }
+}
+
+bool HttpConnectionLimits::acquire(const struct sockaddr* addr, Slot& slot, HttpShedReason& reason) noexcept {
+    if (mMaxConnections == 0 && mMaxPerClient == 0)
+        return true;
+
+    if (mOpen.fetch_add(1, std::memory_order_relaxed) >= mMaxConnections && mMaxConnections > 0) {
+        mOpen.fetch_sub(1, std::memory_order_relaxed);
+        reason = HttpShedReason::ServerFull;
+        return false;
+    }
 
-    if (sock < 0) {
-        perror("accept failed");
-        return {-1};
+    size_t bucket = sClientBuckets;
+
+    if (mMaxPerClient > 0) {
+        std::string_view key;
+        if (addr->sa_family == AF_INET) {
+            auto& in = reinterpret_cast<const struct sockaddr_in*>(addr)->sin_addr;
+            key = {reinterpret_cast<const char*>(&in), sizeof(in)};
+        } else if (addr->sa_family == AF_INET6) {
+            auto& in = reinterpret_cast<const struct sockaddr_in6*>(addr)->sin6_addr;
+            key = {reinterpret_cast<const char*>(&in), sizeof(in)};
+        }
+
+        bucket = std::hash<std::string_view>{}(key) % sClientBuckets;
+
+        if (mClients[bucket].fetch_add(1, std::memory_order_relaxed) >= mMaxPerClient) {
+            mClients[bucket].fetch_sub(1, std::memory_order_relaxed);
+            mOpen.fetch_sub(1, std::memory_order_relaxed);
+            reason = HttpShedReason::ClientFull;
+            return false;
+        }
     }
 
-    return {sock};
+    slot = Slot{};
+    slot.mLimits = this;
+    slot.mBucket = bucket;
+    return true;
+}
+
+void HttpConnectionLimits::Slot::release() noexcept {
+    if (!mLimits)
+        return;
+
+    if (mBucket < sClientBuckets)
+        mLimits->mClients[mBucket].fetch_sub(1, std::memory_order_relaxed);
+
+    mLimits->mOpen.fetch_sub(1, std::memory_order_relaxed);
+    mLimits = nullptr;
 }
 
 void TCPClientStream::send(const void* what, size_t size) {
     if (::send(mSocket, what, size, MSG_NOSIGNAL) < 0)
         throw std::runtime_error("TCP send failed");
+
+    TINYHTTP_METRIC(bytesOut(size));
 }
 
-size_t TCPClientStream::receive(void* target, size_t max) {
-    ssize_t len;
+void TCPClientStream::sendv(struct iovec* parts, size_t count) {
+    struct msghdr msg = {};
+
+    while (count > 0) {
+        msg.msg_iov = parts;
+        msg.msg_iovlen = count;
+
+        ssize_t len = sendmsg(mSocket, &msg, MSG_NOSIGNAL);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+
+            throw std::runtime_error("TCP send failed");
+        }
+
+        TINYHTTP_METRIC(bytesOut(len));
+
+        // skip what went out and retry with the rest
+        size_t sent = len;
+        while (count > 0 && sent >= parts->iov_len) {
+            sent -= parts->iov_len;
+            parts++;
+            count--;
+        }
+
+        if (count > 0) {
+            parts->iov_base = reinterpret_cast<uint8_t*>(parts->iov_base) + sent;
+            parts->iov_len -= sent;
+        }
+    }
+}
+
+// largest chunk handed to a single sendfile call
+static constexpr size_t sMaxSendfileChunk = 1024*1024;
+
+void IClientStream::sendFile(int fd, off_t offset, size_t length) {
+    uint8_t buffer[16*1024];
+
+    while (length > 0) {
+        ssize_t len = pread(fd, buffer, std::min(length, sizeof(buffer)), offset);
+        if (len < 0 && errno == EINTR)
+            continue;
+
+        if (len <= 0)
+            throw std::runtime_error("file read failed");
+
+        send(buffer, len);
+        offset += len;
+        length -= len;
+    }
+}
+
+void TCPClientStream::sendFile(int fd, off_t offset, size_t length) {
+    while (length > 0) {
+        ssize_t len = sendfile(mSocket, fd, &offset, std::min(length, sMaxSendfileChunk));
+        if (len < 0 && errno == EINTR)
+            continue;
+
+        // 0 means the file got shorter than announced, the response can't be completed
+        if (len <= 0)
+            throw std::runtime_error("TCP sendfile failed");
+
+        TINYHTTP_METRIC(bytesOut(len));
+        length -= len;
+    }
+}
 
-    if ((len = recv(mSocket, target, max, MSG_NOSIGNAL)) < 0)
+size_t TCPClientStream::fillReadBuffer() {
+    size_t available;
+    char* target = mReadBuffer.prepare(TINYHTTP_READ_BUFFER_SIZE / 4, available);
+
+    ssize_t len = recv(mSocket, target, available, MSG_NOSIGNAL);
+    if (len < 0)
         throw std::runtime_error("TCP receive failed");
 
+    TINYHTTP_METRIC(bytesIn(len));
+    mReadBuffer.commit(len);
     return static_cast<size_t>(len);
 }
 
+size_t TCPClientStream::receive(void* target, size_t max) {
+    if (!mReadBuffer.empty())
+        return mReadBuffer.read(target, max);
+
+    // large reads skip the buffer
+    if (max >= TINYHTTP_READ_BUFFER_SIZE / 4) {
+        ssize_t len;
+
+        if ((len = recv(mSocket, target, max, MSG_NOSIGNAL)) < 0)
+            throw std::runtime_error("TCP receive failed");
+
+        TINYHTTP_METRIC(bytesIn(len));
+        return static_cast<size_t>(len);
+    }
+
+    fillReadBuffer();
+    return mReadBuffer.read(target, max);
+}
+
 std::string TCPClientStream::receiveLine(bool asciiOnly, size_t max) {
     std::string res;
-    char ch;
 
     while (res.size() < max) {
-        if (recv(mSocket, &ch, 1, MSG_NOSIGNAL) != 1)
+        if (mReadBuffer.empty() && fillReadBuffer() == 0)
             throw std::runtime_error("TCP receive failed");
 
-        if (ch == '\r') continue;
-        if (ch == '\n') break;
+        const char* begin = mReadBuffer.data();
+        const char* end = httpscan::find(begin, mReadBuffer.size(), '\n');
+        size_t len = (end ? end : begin + mReadBuffer.size()) - begin;
+
+        if (asciiOnly && !httpscan::isAscii(begin, len))
+            throw std::runtime_error("Only ASCII characters were allowed");
+
+        for (size_t i = 0; i < len && res.size() < max; i++)
+            if (begin[i] != '\r')
+                res.push_back(begin[i]);
+
+        mReadBuffer.consume(end ? len + 1 : len);
+
+        if (end) break;
+    }
+
+    return res;
+}
+
+char* StreamBuffer::prepare(size_t min, size_t& available) {
+    if (mCapacity - mEnd < min) {
+        size_t used = size();
+
+        if (mCapacity - used >= min && mData) {
+            memmove(mData.get(), mData.get() + mBegin, used);
+        } else {
+            size_t capacity = std::max<size_t>(mCapacity, TINYHTTP_READ_BUFFER_SIZE);
+            while (capacity - used < min)
+                capacity *= 2;
+
+            std::unique_ptr<char[]> data{new char[capacity]};
+            if (used)
+                memcpy(data.get(), mData.get() + mBegin, used);
+
+            mData = std::move(data);
+            mCapacity = capacity;
+        }
+
+        mBegin = 0;
+        mEnd = used;
+    }
+
+    available = mCapacity - mEnd;
+    return mData.get() + mEnd;
+}
+
+static std::string fileETag(const struct stat& st) {
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"",
+        static_cast<unsigned long long>(st.st_ino),
+        static_cast<unsigned long long>(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec,
+        static_cast<unsigned long long>(st.st_size));
+    return etag;
+}
+
+// IMF-fixdate, like "Sun, 06 Nov 1994 08:49:37 GMT"
+static std::string httpDate(time_t time) {
+    struct tm tm;
+    char date[64];
+
+    gmtime_r(&time, &tm);
+    return {date, strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm)};
+}
+
+// accepts the IMF-fixdate and the two obsolete formats
+static bool parseHttpDate(std::string_view text, time_t& time) {
+    static const char* const formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",
+        "%A, %d-%b-%y %H:%M:%S GMT",
+        "%a %b %e %H:%M:%S %Y"
+    };
+
+    std::string copy{text};
+
+    for (auto format : formats) {
+        struct tm tm = {};
+        const char* end = strptime(copy.c_str(), format, &tm);
+
+        if (end && *end == 0) {
+            time = timegm(&tm);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*static*/ std::shared_ptr<HttpFileBody> HttpFileBody::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    return std::shared_ptr<HttpFileBody>(new HttpFileBody{fd, static_cast<size_t>(st.st_size), st.st_mtime, fileETag(st)});
+}
+
+// maximum number of buffers passed to a single writev
+static constexpr size_t sMaxOutputBatch = 64;
+
+size_t OutputQueue::gather(struct iovec* parts, size_t max) const noexcept {
+    size_t count = 0;
+
+    // file and producer segments can't be part of a writev, they end the batch
+    for (size_t i = mFirst; i < mSegments.size() && count < max && mSegments[i].fd < 0 && !mSegments[i].producer; i++) {
+        const Segment& s = mSegments[i];
+        parts[count].iov_base = const_cast<uint8_t*>(s.data ? s.data : mHeadBuffer.data() + s.offset);
+        parts[count].iov_len = s.size;
+        count++;
+    }
+
+    return count;
+}
+
+void OutputQueue::advance(size_t n) noexcept {
+    while (n > 0 && !empty()) {
+        Segment& s = mSegments[mFirst];
+
+        if (n < s.size) {
+            if (s.data)
+                s.data += n;
+            else
+                s.offset += n;
+
+            s.size -= n;
+            return;
+        }
+
+        n -= s.size;
+        pop();
+    }
+}
+
+void OutputQueue::pop() noexcept {
+    mSegments[mFirst].owner.reset();
+    mFirst++;
+
+    if (empty())
+        clear();
+}
+
+bool OutputQueue::produceChunk(const Segment& s) {
+    // the rest of the current chunk goes out first
+    if (mChunkPos < mChunk.size())
+        return true;
+
+    if (mChunkLast) {
+        mChunkLast = false;
+        return false;
+    }
+
+    // sent as it is, the body ends with the first empty part
+    if (!s.chunked) {
+        mChunk.resize(TINYHTTP_CHUNK_SIZE);
+        mChunk.resize(std::min<size_t>((*s.producer)(mChunk.data(), TINYHTTP_CHUNK_SIZE), TINYHTTP_CHUNK_SIZE));
+        mChunkPos = 0;
+        return !mChunk.empty();
+    }
+
+    // the data goes after room for the hex length, which is written right in front of it
+    constexpr size_t reserve = sizeof(size_t) * 2 + 2;
+    mChunk.resize(reserve + TINYHTTP_CHUNK_SIZE + 2);
+    size_t len = std::min<size_t>((*s.producer)(mChunk.data() + reserve, TINYHTTP_CHUNK_SIZE), TINYHTTP_CHUNK_SIZE);
+
+    char header[reserve + 1];
+    int headerLength = snprintf(header, sizeof(header), "%zx\r\n", len);
+    mChunkPos = reserve - headerLength;
+    memcpy(mChunk.data() + mChunkPos, header, headerLength);
+
+    // an empty chunk ends the body: "0\r\n\r\n"
+    memcpy(mChunk.data() + reserve + len, "\r\n", 2);
+    mChunk.resize(reserve + len + 2);
+    mChunkLast = len == 0;
+    return true;
+}
+
+void OutputQueue::commitHead(size_t start) {
+    if (start < mHeadBuffer.size())
+        mSegments.push_back({nullptr, start, mHeadBuffer.size() - start, -1, nullptr, nullptr});
+}
+
+void OutputQueue::push(const void* data, size_t size, std::shared_ptr<const void> owner) {
+    if (size > 0)
+        mSegments.push_back({reinterpret_cast<const uint8_t*>(data), 0, size, -1, nullptr, std::move(owner)});
+}
+
+void OutputQueue::push(std::string&& content) {
+    if (content.empty())
+        return;
+
+    if (mBodiesUsed == mBodies.size())
+        mBodies.push_back(std::make_unique<std::string>());
+
+    std::string& body = *mBodies[mBodiesUsed++];
+    body.swap(content);
+    push(body.data(), body.size());
+}
+
+void OutputQueue::pushFile(std::shared_ptr<const HttpFileBody> file, size_t offset, size_t size) {
+    if (size > 0) {
+        int fd = file->fd();
+        mSegments.push_back({nullptr, offset, size, fd, nullptr, std::move(file)});
+    }
+}
+
+void OutputQueue::pushProducer(const HttpBodyProducer* producer, std::shared_ptr<const void> owner, bool chunked) {
+    mSegments.push_back({nullptr, 0, 0, -1, producer, std::move(owner), chunked});
+}
+
+void OutputQueue::pushProducer(HttpBodyProducer&& producer, bool chunked) {
+    if (mProducersUsed == mProducers.size())
+        mProducers.push_back(std::make_unique<HttpBodyProducer>());
+
+    HttpBodyProducer& slot = *mProducers[mProducersUsed++];
+    slot = std::move(producer);
+    pushProducer(&slot, nullptr, chunked);
+}
+
+void OutputQueue::clear() noexcept {
+    // keeps the capacity, so the next responses don't allocate
+    mSegments.clear();
+    mHeadBuffer.clear();
+    mFirst = 0;
+    mChunk.clear();
+    mChunkPos = 0;
+    mChunkLast = false;
+
+    // large bodies go back to the heap, the rest is kept for the next ones
+    for (size_t i = 0; i < mBodiesUsed; i++) {
+        if (mBodies[i]->capacity() > TINYHTTP_CONTENT_RETAIN)
+            std::string{}.swap(*mBodies[i]);
+        else
+            mBodies[i]->clear();
+    }
+
+    for (size_t i = 0; i < mProducersUsed; i++)
+        *mProducers[i] = nullptr;
+
+    mBodiesUsed = mProducersUsed = 0;
+}
+
+void OutputQueue::flush(IClientStream& stream) {
+    struct iovec parts[sMaxOutputBatch];
+
+    while (!empty()) {
+        const Segment& first = mSegments[mFirst];
+        if (first.fd >= 0) {
+            size_t size = first.size;
+            stream.sendFile(first.fd, first.offset, size);
+            advance(size);
+            continue;
+        }
+
+        if (first.producer) {
+            if (produceChunk(first)) {
+                stream.send(mChunk.data() + mChunkPos, mChunk.size() - mChunkPos);
+                mChunkPos = mChunk.size();
+            } else {
+                pop();
+            }
+
+            continue;
+        }
+
+        size_t count = gather(parts, sMaxOutputBatch);
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++)
+            total += parts[i].iov_len;
+
+        stream.sendv(parts, count);
+        advance(total);
+    }
+}
+
+bool OutputQueue::flush(int socket) {
+    struct iovec parts[sMaxOutputBatch];
+
+    while (!empty()) {
+        const Segment& first = mSegments[mFirst];
+        if (first.fd >= 0) {
+            off_t offset = first.offset;
+            ssize_t len = sendfile(socket, first.fd, &offset, std::min(first.size, sMaxSendfileChunk));
+
+            if (len < 0 && errno == EINTR)
+                continue;
+
+            if (len == 0)
+                errno = EIO; // the file got shorter than announced
+
+            if (len <= 0)
+                return false;
+
+            TINYHTTP_METRIC(bytesOut(len));
+            advance(len);
+            continue;
+        }
+
+        if (first.producer) {
+            try {
+                if (!produceChunk(first)) {
+                    pop();
+                    continue;
+                }
+            } catch (std::exception& e) {
+                // the body can't be completed, the connection has to go
+                TINYHTTP_LOG_ERROR("Exception in response producer (%s)", e.what());
+                errno = EIO;
+                return false;
+            }
+
+            ssize_t len = ::send(socket, mChunk.data() + mChunkPos, mChunk.size() - mChunkPos, MSG_NOSIGNAL);
+            if (len < 0) {
+                if (errno == EINTR)
+                    continue;
+
+                return false;
+            }
+
+            TINYHTTP_METRIC(bytesOut(len));
+            mChunkPos += len;
+            continue;
+        }
+
+        size_t count = gather(parts, sMaxOutputBatch);
+
+        struct msghdr msg = {};
+        msg.msg_iov = parts;
+        msg.msg_iovlen = count;
+
+        ssize_t len = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return false;
+        }
+
+        TINYHTTP_METRIC(bytesOut(len));
+        advance(len);
+    }
+
+    return true;
+}
+
+// numeric address of the peer of `socket`, "-" if it's not an IP socket
+static void formatPeerAddress(int socket, char* out, size_t size) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    const void* ip = nullptr;
+    if (getpeername(socket, reinterpret_cast<struct sockaddr*>(&addr), &len) == 0) {
+        if (addr.ss_family == AF_INET)
+            ip = &reinterpret_cast<struct sockaddr_in*>(&addr)->sin_addr;
+        else if (addr.ss_family == AF_INET6)
+            ip = &reinterpret_cast<struct sockaddr_in6*>(&addr)->sin6_addr;
+    }
+
+    if (!ip || !inet_ntop(addr.ss_family, ip, out, size))
+        snprintf(out, size, "-");
+}
+
+std::string_view TCPClientStream::peerAddress() {
+    if (!mPeer[0])
+        formatPeerAddress(mSocket, mPeer, sizeof(mPeer));
+
+    return mPeer;
+}
+
+void TCPClientStream::close() {
+    if (mSocket < 0) return;
+    ::shutdown(mSocket, SHUT_RDWR);
+    ::close(mSocket);
+    mSocket = -1;
+    mSlot.release();
+    TINYHTTP_METRIC(connectionClosed());
+}
+
+static constexpr std::string_view sHeaderNames[] = {
+    "Accept", "Accept-Ranges", "Cache-Control", "Connection", "Content-Length", "Content-Range", "Content-Type",
+    "Cookie", "Date", "ETag", "Expect", "Host", "If-Modified-Since", "If-None-Match", "If-Range", "Keep-Alive",
+    "Last-Modified", "Location", "Range", "Server", "Set-Cookie", "Transfer-Encoding", "Upgrade", "User-Agent"
+};
+
+static_assert(sizeof(sHeaderNames) / sizeof(sHeaderNames[0]) == static_cast<size_t>(HttpHeader::Unknown));
+
+static constexpr size_t headerNameHash(std::string_view name) noexcept {
+    return (name.size() * 7 + asciiToLower(name.front()) * 3 + asciiToLower(name.back())) & 63;
+}
+
+// open addressing table of the well-known header names, built at compile time
+struct HeaderNameIndex {
+    uint8_t slots[64] = {};
+
+    constexpr HeaderNameIndex() {
+        for (auto& slot : slots)
+            slot = 0xFF;
+
+        for (size_t i = 0; i < static_cast<size_t>(HttpHeader::Unknown); i++) {
+            size_t h = headerNameHash(sHeaderNames[i]);
+            while (slots[h] != 0xFF)
+                h = (h + 1) & 63;
+
+            slots[h] = static_cast<uint8_t>(i);
+        }
+    }
+};
+
+static constexpr HeaderNameIndex sHeaderNameIndex{};
+
+std::string_view httpHeaderName(HttpHeader id) noexcept {
+    return id < HttpHeader::Unknown ? sHeaderNames[static_cast<size_t>(id)] : std::string_view{};
+}
+
+HttpHeader httpHeaderId(std::string_view name) noexcept {
+    if (name.empty())
+        return HttpHeader::Unknown;
+
+    for (size_t h = headerNameHash(name);; h = (h + 1) & 63) {
+        uint8_t slot = sHeaderNameIndex.slots[h];
+
+        if (slot == 0xFF)
+            return HttpHeader::Unknown;
+
+        if (equalsIgnoreCase(sHeaderNames[slot], name))
+            return static_cast<HttpHeader>(slot);
+    }
+}
+
+static inline bool isHttpWhitespace(char ch) noexcept {
+    return ch == ' ' || ch == '\t';
+}
+
+static std::string_view trimWhitespace(std::string_view text) noexcept {
+    while (!text.empty() && isHttpWhitespace(text.front()))
+        text.remove_prefix(1);
+    while (!text.empty() && isHttpWhitespace(text.back()))
+        text.remove_suffix(1);
+
+    return text;
+}
+
+bool HttpRequestParser::parseRequestLine(const char* data, size_t begin, size_t end) noexcept {
+    Span* parts[] = { &mMethod, &mTarget, &mVersion };
+    size_t count = 0;
+
+    for (size_t i = begin; i < end && count < 3;) {
+        while (i < end && isHttpWhitespace(data[i])) i++;
+        if (i == end) break;
+
+        size_t tokenBegin = i;
+        while (i < end && !isHttpWhitespace(data[i])) i++;
+
+        parts[count]->offset = tokenBegin;
+        parts[count]->length = i - tokenBegin;
+        count++;
+    }
+
+    // the version is optional, like it always was
+    return count >= 2 && httpscan::isToken(data + mMethod.offset, mMethod.length);
+}
+
+bool HttpRequestParser::parseHeader(const char* data, size_t begin, size_t end) noexcept {
+    if (mHeaderCount >= MAX_HTTP_HEADERS)
+        return false;
+
+    const char* colon = httpscan::find(data + begin, end - begin, ':');
+    if (!colon || !httpscan::isToken(data + begin, colon - (data + begin)))
+        return false;
+
+    size_t nameEnd = colon - data, valueBegin = nameEnd + 1, valueEnd = end;
+
+    while (valueBegin < valueEnd && isHttpWhitespace(data[valueBegin])) valueBegin++;
+    while (valueEnd > valueBegin && isHttpWhitespace(data[valueEnd - 1])) valueEnd--;
+
+    Header& h = mHeaders[mHeaderCount++];
+    h.name = { static_cast<uint32_t>(begin), static_cast<uint32_t>(nameEnd - begin) };
+    h.value = { static_cast<uint32_t>(valueBegin), static_cast<uint32_t>(valueEnd - valueBegin) };
+    return true;
+}
+
+HttpRequestParser::Status HttpRequestParser::parse(const char* data, size_t size) noexcept {
+    while (mState == State::RequestLine || mState == State::Headers) {
+        const char* eol = httpscan::find(data + mPos, size - mPos, '\n');
+
+        if (!eol) {
+            if (size - mPos > MAX_HTTP_LINE_LENGTH)
+                mState = State::Error;
+
+            break;
+        }
+
+        size_t lineBegin = mPos, lineEnd = eol - data;
+        if (lineEnd > lineBegin && data[lineEnd - 1] == '\r')
+            lineEnd--;
+
+        bool ok = lineEnd - lineBegin <= MAX_HTTP_LINE_LENGTH
+               && httpscan::isAscii(data + lineBegin, lineEnd - lineBegin)
+               && !httpscan::find(data + lineBegin, lineEnd - lineBegin, '\r');
+
+        mPos = eol - data + 1;
+
+        // also bounds the empty lines allowed before the request line
+        if (mPos > sMaxHeadLength)
+            ok = false;
+
+        if (!ok) {
+            mState = State::Error;
+        } else if (mState == State::RequestLine) {
+            // empty lines before the request line are ignored
+            if (lineBegin != lineEnd)
+                mState = parseRequestLine(data, lineBegin, lineEnd) ? State::Headers : State::Error;
+        } else if (lineBegin == lineEnd) {
+            mState = State::Done;
+        } else if (!parseHeader(data, lineBegin, lineEnd)) {
+            mState = State::Error;
+        }
+    }
+
+    switch (mState) {
+        case State::Done:  return Status::Complete;
+        case State::Error: return Status::Error;
+        default:           return Status::Incomplete;
+    }
+}
+
+bool HttpRequest::parse(const HttpRequestParser& parser, const char* head) {
+    // the object may be reused for the next request of a connection, keeping its memory
+    // unless the last body was large
+    if (mContent.capacity() > TINYHTTP_CONTENT_RETAIN)
+        std::string{}.swap(mContent);
+    else
+        mContent.clear();
+
+    #ifdef TINYHTTP_JSON
+    mContentJson = miniJson::Json{};
+    #endif
+
+    mBodyReader = nullptr;
+    mPathParams.clear();
+
+    mHead.assign(head, parser.headLength());
+    mMethodName = parser.method();
+    mRequestHeaderCount = parser.headerCount();
+    std::copy(parser.headers(), parser.headers() + mRequestHeaderCount, mRequestHeaders);
+
+    // the first occurrence of a well-known header gets its slot
+    memset(mKnownRequestHeaders, 0xFF, sizeof(mKnownRequestHeaders));
+    for (size_t i = mRequestHeaderCount; i-- > 0;) {
+        HttpHeader id = httpHeaderId(mRequestHeaders[i].name.in(mHead.data()));
+        if (id != HttpHeader::Unknown)
+            mKnownRequestHeaders[static_cast<size_t>(id)] = static_cast<uint8_t>(i);
+    }
+
+    std::string_view methodString = getMethodName();
+         if (methodString == "GET"    ) { mMethod = HttpRequestMethod::GET;     }
+    else if (methodString == "POST"   ) { mMethod = HttpRequestMethod::POST;    }
+    else if (methodString == "PUT"    ) { mMethod = HttpRequestMethod::PUT;     }
+    else if (methodString == "DELETE" ) { mMethod = HttpRequestMethod::DELETE;  }
+    else if (methodString == "OPTIONS") { mMethod = HttpRequestMethod::OPTIONS; }
+    else return false;
+
+    // only HTTP/1.x is spoken here, a request line without a version is an HTTP/1.0 one
+    std::string_view version = parser.version().in(mHead.data());
+    if (version.empty()) {
+        mVersionMajor = 1;
+        mVersionMinor = 0;
+    } else if (version.size() == 8 && version.substr(0, 7) == "HTTP/1." && version[7] >= '0' && version[7] <= '9') {
+        mVersionMajor = 1;
+        mVersionMinor = version[7] - '0';
+    } else return false;
+
+    std::string_view target = parser.target().in(mHead.data());
+
+    size_t question = target.find('?');
+    if (question != std::string_view::npos) {
+        path.assign(target.substr(0, question));
+        query.assign(target.substr(question));
+    } else {
+        path.assign(target);
+        query.clear();
+    }
+
+    return true;
+}
+
+// true if the comma separated `list` (like a Connection header) has `token`, ignoring case
+static bool hasToken(std::string_view list, std::string_view token) noexcept {
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        if (equalsIgnoreCase(trimWhitespace(list.substr(0, comma)), token))
+            return true;
+
+        if (comma == std::string_view::npos)
+            break;
+
+        list.remove_prefix(comma + 1);
+    }
+
+    return false;
+}
+
+bool HttpRequest::keepAlive() const noexcept {
+    std::string_view connection = header(HttpHeader::Connection);
+
+    if (mVersionMajor == 1 && mVersionMinor == 0)
+        return hasToken(connection, "keep-alive");
+
+    return !hasToken(connection, "close");
+}
+
+std::string_view HttpRequest::header(HttpHeader id) const noexcept {
+    if (id == HttpHeader::Unknown || mRequestHeaderCount == 0)
+        return {};
+
+    uint8_t slot = mKnownRequestHeaders[static_cast<size_t>(id)];
+    return slot == 0xFF ? std::string_view{} : mRequestHeaders[slot].value.in(mHead.data());
+}
+
+std::string_view HttpRequest::header(std::string_view name) const noexcept {
+    HttpHeader id = httpHeaderId(name);
+    if (id != HttpHeader::Unknown)
+        return header(id);
+
+    for (size_t i = 0; i < mRequestHeaderCount; i++)
+        if (equalsIgnoreCase(mRequestHeaders[i].name.in(mHead.data()), name))
+            return mRequestHeaders[i].value.in(mHead.data());
+
+    return {};
+}
+
+size_t HttpRequest::getContentLength() const {
+    std::string contentLength{header(HttpHeader::ContentLength)};
+    ssize_t cl = std::atoll(contentLength.c_str());
+
+    if (cl > MAX_HTTP_CONTENT_SIZE)
+        throw std::runtime_error("request too large");
+
+    return cl > 0 ? static_cast<size_t>(cl) : 0;
+}
+
+void HttpRequest::acceptContent(std::string content) {
+    mContent = std::move(content);
+    contentReceived();
+}
+
+void HttpRequest::acceptContent(const char* data, size_t size) {
+    mContent.assign(data, size);
+    contentReceived();
+}
+
+void HttpRequest::receiveContent(HttpBodyReader& body) {
+    mContent.clear();
+    body.readAll(mContent);
+    contentReceived();
+}
+
+void HttpRequest::contentReceived() {
+    #ifdef TINYHTTP_JSON
+    std::string_view contentType = header(HttpHeader::ContentType);
+    if (    contentType == "application/json"
+        ||  contentType.rfind("application/json;",0) == 0 // some clients gives us extra data like charset
+    ) {
+        std::string error;
+        mContentJson = miniJson::Json::parse(mContent, error);
+        if (!error.empty())
+            TINYHTTP_LOG_ERROR("Content type was JSON but we couldn't parse it! %s", error.c_str());
+    }
+    #endif
+}
+
+std::string_view HttpRequest::param(std::string_view name) const noexcept {
+    auto p = mPathParams.find(name);
+    return p ? std::string_view{path}.substr(p->offset, p->length) : std::string_view{};
+}
+
+std::optional<int64_t> HttpRequest::paramInt(std::string_view name) const noexcept {
+    auto value = param(name);
+
+    int64_t number;
+    auto res = std::from_chars(value.data(), value.data()+value.size(), number);
+    if (value.empty() || res.ec != std::errc{} || res.ptr != value.data()+value.size())
+        return std::nullopt;
+
+    return number;
+}
+
+bool HttpRequest::hasBody() const noexcept {
+    auto contentLength = header(HttpHeader::ContentLength);
+    return isChunked() || contentLength.find_first_not_of('0') != std::string_view::npos;
+}
+
+bool HttpRequest::parse(std::shared_ptr<IClientStream> stream) {
+    if (!parseHead(stream))
+        return false;
+
+    HttpBodyReader body{*stream, *this, MAX_HTTP_CONTENT_SIZE};
+    if (body.limitExceeded())
+        throw std::runtime_error("request too large");
+
+    if (!body.finished())
+        acceptContent(body.readAll());
+
+    return true;
+}
+
+bool HttpRequest::parseHead(std::shared_ptr<IClientStream> stream) {
+    HttpRequestParser parser;
+    auto status = HttpRequestParser::Status::Incomplete;
+    StreamBuffer* buffer = stream->readBuffer();
+
+    if (buffer) {
+        while ((status = parser.parse(buffer->data(), buffer->size())) == HttpRequestParser::Status::Incomplete)
+            if (stream->fillReadBuffer() == 0)
+                throw std::runtime_error("Connection closed while receiving request");
+
+        if (status == HttpRequestParser::Status::Error || !parse(parser, buffer->data()))
+            return false;
+
+        buffer->consume(parser.headLength());
+    } else {
+        // streams without a read buffer are parsed line by line
+        std::string head;
+
+        while (status == HttpRequestParser::Status::Incomplete) {
+            head += stream->receiveLine();
+            head += "\r\n";
+            status = parser.parse(head.data(), head.size());
+        }
+
+        if (status == HttpRequestParser::Status::Error || !parse(parser, head.data()))
+            return false;
+    }
+
+    return true;
+}
+
+HttpBodyReader::HttpBodyReader(IClientStream& stream, const HttpRequest& request, size_t limit)
+    : mStream{&stream}, mLimit{limit} {
+    if (request.isChunked()) {
+        // chunked has to be the only coding, compressed request bodies are not supported
+        if (!equalsIgnoreCase(trimWhitespace(request.header(HttpHeader::TransferEncoding)), "chunked"))
+            throw std::runtime_error("unsupported transfer encoding");
+
+        mChunked = true;
+    } else {
+        auto contentLength = request.header(HttpHeader::ContentLength);
+        auto end = contentLength.data() + contentLength.size();
+
+        if (!contentLength.empty() && std::from_chars(contentLength.data(), end, mRemaining).ptr != end)
+            throw std::runtime_error("invalid content length");
+
+        mLimitExceeded = mRemaining > mLimit;
+        mFinished = mRemaining == 0;
+    }
+
+    mContinuePending = !mFinished && request.expectsContinue();
+}
+
+void HttpBodyReader::nextChunk() {
+    // the data of the previous chunk is followed by a CRLF
+    if (mInChunk && !mStream->receiveLine(true, 2).empty())
+        throw std::runtime_error("malformed chunk");
+
+    std::string line = mStream->receiveLine(true, MAX_HTTP_LINE_LENGTH);
+    auto sizeText = trimWhitespace(std::string_view{line}.substr(0, line.find(';')));
+    auto end = sizeText.data() + sizeText.size();
+
+    size_t size;
+    if (sizeText.empty() || std::from_chars(sizeText.data(), end, size, 16).ptr != end)
+        throw std::runtime_error("malformed chunk size");
+
+    if (size == 0) {
+        // trailer fields are skipped
+        for (size_t i = 0; !mStream->receiveLine(true, MAX_HTTP_LINE_LENGTH).empty(); i++)
+            if (i >= MAX_HTTP_HEADERS)
+                throw std::runtime_error("too many trailer fields");
+
+        mFinished = true;
+        return;
+    }
+
+    if (size > mLimit - mReceived) {
+        mLimitExceeded = true;
+        throw std::runtime_error("request body too large");
+    }
+
+    mRemaining = size;
+    mInChunk = true;
+}
+
+size_t HttpBodyReader::read(void* target, size_t max) {
+    if (mLimitExceeded)
+        throw std::runtime_error("request body too large");
+
+    if (mMemory) {
+        size_t len = std::min(max, mRemaining);
+        memcpy(target, mMemory + mReceived, len);
+        mReceived += len;
+        mRemaining -= len;
+        mFinished = mRemaining == 0;
+        return len;
+    }
+
+    if (mContinuePending) {
+        static const char continueMessage[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        mContinuePending = false;
+        mStream->send(continueMessage, sizeof(continueMessage) - 1);
+    }
+
+    if (mChunked && mRemaining == 0 && !mFinished)
+        nextChunk();
+
+    if (mFinished || max == 0)
+        return 0;
+
+    size_t len = mStream->receive(target, std::min(max, mRemaining));
+    if (len == 0)
+        throw std::runtime_error("connection closed while receiving the body");
+
+    mReceived += len;
+    mRemaining -= len;
+
+    if (!mChunked && mRemaining == 0)
+        mFinished = true;
+
+    return len;
+}
+
+std::string HttpBodyReader::readAll() {
+    std::string content;
+    readAll(content);
+    return content;
+}
+
+void HttpBodyReader::readAll(std::string& content) {
+    if (!mChunked)
+        content.reserve(content.size() + mRemaining);
+
+    while (!mFinished) {
+        size_t pos = content.size();
+        size_t want = mChunked ? TINYHTTP_READ_BUFFER_SIZE : mRemaining;
+
+        content.resize(pos + want);
+        content.resize(pos + read(&content[pos], want));
+    }
+}
+
+static constexpr std::string_view sServerHeader = "Server: tinyHTTP_1.1\r\n";
+
+// "Date: <now>\r\n", formatted at most once per second on each thread
+static std::string_view dateHeader() {
+    thread_local time_t formatted = -1;
+    thread_local char line[64];
+    thread_local size_t length = 0;
+
+    time_t now = time(nullptr);
+    if (now != formatted) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        length = strftime(line, sizeof(line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        formatted = now;
+    }
+
+    return {line, length};
+}
+
+// contents up to this size are copied next to the head by moveInto
+static constexpr size_t sMaxInlineContent = 4096;
+
+void HttpResponse::serializeHead(MessageBuilder& out) const {
+    if (mPrepared) {
+        out.write(mPrepared->head.data(), mPrepared->head.size());
+    } else if (mStatusCode >= 100 && mStatusCode <= 999) {
+        char statusLine[] = "HTTP/1.1 000\r\n";
+        statusLine[9] += mStatusCode / 100;
+        statusLine[10] += mStatusCode / 10 % 10;
+        statusLine[11] += mStatusCode % 10;
+        out.write(statusLine, sizeof(statusLine) - 1);
+    } else {
+        out.write("HTTP/1.1 " + std::to_string(mStatusCode));
+        out.writeCRLF();
+    }
+
+    serializeHeaders(out);
+}
+
+void HttpResponse::serializeHeaders(MessageBuilder& out) const {
+    for (auto& h : mHeaders) {
+        if (h.value.empty())
+            continue;
+
+        auto name = h.name();
+        out.write(name.data(), name.size());
+        out.write(": ", 2);
+        out.write(h.value);
+        out.writeCRLF();
+    }
+
+    if (!mHeaders.find(HttpHeader::Server))
+        out.write(sServerHeader.data(), sServerHeader.size());
+
+    if (!mHeaders.find(HttpHeader::Date)) {
+        auto date = dateHeader();
+        out.write(date.data(), date.size());
+    }
+
+    out.writeCRLF();
+}
+
+void HttpResponse::enqueue(OutputQueue& out, std::shared_ptr<const void> owner) const {
+    if (mPrepared) {
+        out.push(mPrepared->head.data(), mPrepared->head.size(), mPrepared);
+
+        size_t start = out.headBuffer().size();
+        serializeHeaders(out.headBuffer());
+        out.commitHead(start);
+
+        out.push(mPrepared->content.data(), mPrepared->content.size(), mPrepared);
+        return;
+    }
+
+    size_t start = out.headBuffer().size();
+    serializeHead(out.headBuffer());
+    out.commitHead(start);
+
+    if (mProducer)
+        out.pushProducer(&mProducer, owner, isChunked());
+    else if (mFile && mFileParts.empty())
+        out.pushFile(mFile, 0, mFile->length());
+    else if (mFile) {
+        for (auto& part : mFileParts) {
+            out.push(part.prefix.data(), part.prefix.size(), owner);
+            out.pushFile(mFile, part.offset, part.length);
+        }
+    } else
+        out.push(mContent.data(), mContent.size(), std::move(owner));
+}
+
+long long HttpResponse::contentLength() const noexcept {
+    if (mPrepared)
+        return mPrepared->content.size();
+
+    auto value = mHeaders.find(HttpHeader::ContentLength);
+    if (!value || value->empty())
+        return -1;
+
+    long long length = -1;
+    std::from_chars(value->data(), value->data() + value->size(), length);
+    return length;
+}
+
+void HttpResponse::moveInto(OutputQueue& out) {
+    if (mPrepared) {
+        enqueue(out); // the prepared parts are owned by the queue
+        return;
+    }
+
+    MessageBuilder& head = out.headBuffer();
+    size_t start = head.size();
+    serializeHead(head);
+
+    if (mProducer) {
+        out.commitHead(start);
+        out.pushProducer(std::move(mProducer), isChunked());
+    } else if (mFile && mFileParts.empty()) {
+        out.commitHead(start);
+        out.pushFile(mFile, 0, mFile->length());
+    } else if (mFile) {
+        for (auto& part : mFileParts) {
+            head.write(part.prefix);
+            out.commitHead(start);
+            out.pushFile(mFile, part.offset, part.length);
+            start = head.size();
+        }
+    } else if (mContent.size() <= sMaxInlineContent) {
+        head.write(mContent);
+        out.commitHead(start);
+    } else {
+        out.commitHead(start);
+        out.push(std::move(mContent));
+    }
+}
+
+#ifndef TINYHTTP_THREADING
+// how stale a cached file may be served after it changed
+static constexpr std::chrono::milliseconds sDrainInterval{100};
+#endif
+
+HttpFileCache::HttpFileCache(size_t budget, size_t maxFileSize)
+    : mBudget{budget}, mMaxFileSize{std::min(budget, maxFileSize)} {
+    // without inotify nothing is cached, files are served from the disk
+    mInotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (mInotify < 0) {
+        perror("inotify_init1");
+        return;
+    }
+
+    #ifdef TINYHTTP_THREADING
+    mWakeFd = eventfd(0, EFD_CLOEXEC);
+    if (mWakeFd < 0) {
+        perror("eventfd");
+        ::close(mInotify);
+        mInotify = -1;
+        return;
+    }
+
+    mWatcherThread.reset(new std::thread{[this]() { this->watcherThreadProc(); }});
+    #endif
+}
+
+HttpFileCache::~HttpFileCache() {
+    #ifdef TINYHTTP_THREADING
+    if (mWatcherThread) {
+        mMutex.lock();
+        mShutdown = true;
+        mMutex.unlock();
+
+        uint64_t one = 1;
+        if (::write(mWakeFd, &one, sizeof(one)) < 0)
+            perror("write");
+
+        mWatcherThread->join();
+    }
+
+    if (mWakeFd >= 0)
+        ::close(mWakeFd);
+    #endif
+
+    if (mInotify >= 0)
+        ::close(mInotify);
+}
+
+#ifdef TINYHTTP_THREADING
+void HttpFileCache::watcherThreadProc() {
+    struct pollfd fds[2] = {{mInotify, POLLIN, 0}, {mWakeFd, POLLIN, 0}};
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("poll");
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock{mMutex};
+        if (mShutdown)
+            return;
+
+        processEvents();
+    }
+}
+#endif
+
+bool HttpFileCache::watchDirectory(const std::string& path) {
+    size_t pos = path.rfind('/');
+    std::string dir = pos == std::string::npos ? "." : path.substr(0, pos);
+
+    int wd = inotify_add_watch(mInotify, pos == 0 ? "/" : dir.c_str(),
+        IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+        IN_DELETE_SELF | IN_MOVE_SELF);
+
+    if (wd < 0)
+        return false;
+
+    // the same directory can be reached through differently spelled paths
+    auto range = mWatches.equal_range(wd);
+    for (auto it = range.first; it != range.second; ++it)
+        if (it->second == dir)
+            return true;
+
+    mWatches.emplace(wd, std::move(dir));
+    return true;
+}
+
+void HttpFileCache::processEvents() {
+    alignas(struct inotify_event) char buffer[4096];
+
+    while (true) {
+        ssize_t len = ::read(mInotify, buffer, sizeof(buffer));
+        if (len < 0 && errno == EINTR)
+            continue;
+
+        if (len <= 0)
+            return;
+
+        for (ssize_t i = 0; i < len;) {
+            auto ev = reinterpret_cast<const struct inotify_event*>(buffer + i);
+            i += sizeof(struct inotify_event) + ev->len;
+            mGeneration++;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // events were lost, nothing can be trusted
+                mLru.clear();
+                mEntries.clear();
+                mUsed = 0;
+                continue;
+            }
+
+            auto range = mWatches.equal_range(ev->wd);
+
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT | IN_IGNORED)) {
+                for (auto it = range.first; it != range.second; ++it)
+                    invalidateDirectory(it->second);
+
+                if (!(ev->mask & IN_IGNORED))
+                    inotify_rm_watch(mInotify, ev->wd);
+
+                mWatches.erase(range.first, range.second);
+                continue;
+            }
+
+            if (ev->len > 0)
+                for (auto it = range.first; it != range.second; ++it)
+                    invalidate(it->second + "/" + ev->name);
+        }
+    }
+}
+
+void HttpFileCache::invalidate(const std::string& path) {
+    auto it = mEntries.find(path);
+    if (it == mEntries.end())
+        return;
+
+    mUsed -= it->second->cost;
+    mLru.erase(it->second);
+    mEntries.erase(it);
+}
+
+void HttpFileCache::invalidateDirectory(const std::string& dir) {
+    std::string prefix = dir + "/";
+
+    for (auto it = mLru.begin(); it != mLru.end();) {
+        if (it->path.compare(0, prefix.size(), prefix) == 0) {
+            mUsed -= it->cost;
+            mEntries.erase(it->path);
+            it = mLru.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+std::shared_ptr<const HttpPreparedResponse> HttpFileCache::find(const std::string& path) {
+    #ifdef TINYHTTP_THREADING
+    std::unique_lock<std::mutex> lock{mMutex};
+    #else
+    // there is no watcher thread, changes are picked up here without a read on every hit
+    auto now = std::chrono::steady_clock::now();
+    if (now >= mNextDrain) {
+        processEvents();
+        mNextDrain = now + sDrainInterval;
+    }
+    #endif
+
+    auto it = mEntries.find(path);
+    if (it == mEntries.end())
+        return nullptr;
+
+    mLru.splice(mLru.begin(), mLru, it->second);
+    return it->second->response;
+}
+
+std::shared_ptr<const HttpPreparedResponse> HttpFileCache::load(const std::string& path, const std::string& mimeType) {
+    if (mInotify < 0)
+        return nullptr;
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+
+    uint64_t generation;
+
+    {
+        #ifdef TINYHTTP_THREADING
+        std::unique_lock<std::mutex> lock{mMutex};
+        #endif
+
+        // watch before looking at the file, so changes made while loading are noticed
+        if (!watchDirectory(path)) {
+            ::close(fd);
+            return nullptr;
+        }
+
+        generation = mGeneration;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || static_cast<size_t>(st.st_size) > mMaxFileSize) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    auto prepared = std::make_shared<HttpPreparedResponse>();
+    prepared->content.resize(st.st_size);
+
+    size_t done = 0;
+    while (done < prepared->content.size()) {
+        ssize_t len = ::read(fd, &prepared->content[done], prepared->content.size() - done);
+        if (len < 0 && errno == EINTR)
+            continue;
+
+        if (len <= 0)
+            break;
+
+        done += len;
+    }
+
+    ::close(fd);
+
+    if (done != prepared->content.size())
+        return nullptr;
+
+    prepared->etag = fileETag(st);
+    prepared->modified = st.st_mtime;
+    prepared->lastModified = httpDate(st.st_mtime);
+
+    HttpResponse head{200};
+    head[HttpHeader::ContentType] = mimeType;
+    head[HttpHeader::ContentLength] = std::to_string(done);
+    head[HttpHeader::AcceptRanges] = "bytes";
+    head[HttpHeader::ETag] = prepared->etag;
+    head[HttpHeader::LastModified] = prepared->lastModified;
+    head[HttpHeader::Server] = head[HttpHeader::Date] = ""; // added when sending
+    head.serializeHead(prepared->head);
+    prepared->head.resize(prepared->head.size() - 2); // the closing empty line is added when sending
+
+    #ifdef TINYHTTP_THREADING
+    std::unique_lock<std::mutex> lock{mMutex};
+    #else
+    processEvents();
+    #endif
+
+    if (generation == mGeneration) {
+        size_t cost = prepared->content.size() + prepared->head.size() + path.size();
+
+        invalidate(path);
+        mLru.push_front({path, prepared, cost});
+        mEntries[path] = mLru.begin();
+        mUsed += cost;
+
+        while (mUsed > mBudget) {
+            mUsed -= mLru.back().cost;
+            mEntries.erase(mLru.back().path);
+            mLru.pop_back();
+        }
+    }
+
+    return prepared;
+}
+
+size_t HttpFileCache::memoryUsed() {
+    #ifdef TINYHTTP_THREADING
+    std::unique_lock<std::mutex> lock{mMutex};
+    #endif
+
+    return mUsed;
+}
+
+/*static*/ bool HttpHandlerBuilder::isNotModified(const HttpRequest& req, std::string_view etag, time_t modified) {
+    if (req.getMethod() != HttpRequestMethod::GET)
+        return false;
+
+    // If-None-Match takes precedence, If-Modified-Since is only looked at without it
+    auto noneMatch = req.header(HttpHeader::IfNoneMatch);
+    if (!noneMatch.empty()) {
+        auto opaque = [](std::string_view tag) {
+            return tag.substr(0, 2) == "W/" ? tag.substr(2) : tag;
+        };
+
+        while (!noneMatch.empty()) {
+            size_t comma = noneMatch.find(',');
+            auto tag = trimWhitespace(noneMatch.substr(0, comma));
+            noneMatch = comma == std::string_view::npos ? std::string_view{} : noneMatch.substr(comma + 1);
+
+            // weak comparison, as GET allows
+            if (tag == "*" || opaque(tag) == opaque(etag))
+                return true;
+        }
+
+        return false;
+    }
+
+    time_t since = 0;
+    auto modifiedSince = req.header(HttpHeader::IfModifiedSince);
+    return !modifiedSince.empty() && parseHttpDate(modifiedSince, since) && modified <= since;
+}
+
+/*static*/ HttpResponse HttpHandlerBuilder::notModified(std::string etag, std::string lastModified) {
+    HttpResponse res{304};
+    res[HttpHeader::ContentLength] = "";
+    res[HttpHeader::ETag] = std::move(etag);
+    res[HttpHeader::LastModified] = std::move(lastModified);
+    return res;
+}
+
+/*static*/ std::optional<HttpResponse> HttpHandlerBuilder::rangeResponse(const HttpRequest& req, std::shared_ptr<HttpFileBody> file, const std::string& mimeType) {
+    // the range only applies if the client still has the same version of the file
+    auto ifRange = req.header(HttpHeader::IfRange);
+    if (!ifRange.empty()) {
+        time_t date;
+        if (ifRange.front() == '"' ? ifRange != file->etag() : !parseHttpDate(ifRange, date) || date != file->modified())
+            return std::nullopt;
+    }
+
+    auto spec = req.header(HttpHeader::Range);
+    size_t eq = spec.find('=');
+    if (eq == std::string_view::npos || !equalsIgnoreCase(trimWhitespace(spec.substr(0, eq)), "bytes"))
+        return std::nullopt;
+
+    auto parseNumber = [](std::string_view text, size_t& value) {
+        auto end = text.data() + text.size();
+        return !text.empty() && std::from_chars(text.data(), end, value).ptr == end;
+    };
+
+    // invalid or too many ranges make the whole header ignored
+    const size_t size = file->length();
+    std::vector<std::pair<size_t, size_t>> ranges; // first and last byte
+    size_t specCount = 0;
+
+    for (spec = spec.substr(eq + 1); !spec.empty();) {
+        size_t comma = spec.find(',');
+        auto range = trimWhitespace(spec.substr(0, comma));
+        spec = comma == std::string_view::npos ? std::string_view{} : spec.substr(comma + 1);
+
+        if (range.empty())
+            continue;
+
+        size_t dash = range.find('-');
+        if (dash == std::string_view::npos || ++specCount > MAX_HTTP_RANGES)
+            return std::nullopt;
+
+        auto firstText = trimWhitespace(range.substr(0, dash)), lastText = trimWhitespace(range.substr(dash + 1));
+        size_t first, last = size - 1;
+
+        if (firstText.empty()) {
+            // suffix range, the last N bytes
+            size_t suffix;
+            if (!parseNumber(lastText, suffix))
+                return std::nullopt;
+
+            if (suffix == 0 || size == 0)
+                continue;
+
+            first = suffix < size ? size - suffix : 0;
+        } else {
+            if (!parseNumber(firstText, first) || (!lastText.empty() && (!parseNumber(lastText, last) || last < first)))
+                return std::nullopt;
+
+            if (first >= size)
+                continue;
+
+            last = std::min(last, size - 1);
+        }
+
+        ranges.emplace_back(first, last);
+    }
+
+    if (specCount == 0)
+        return std::nullopt;
+
+    if (ranges.empty()) {
+        HttpResponse res{416, "text/plain", "416 range not satisfiable"};
+        res[HttpHeader::ContentRange] = "bytes */" + std::to_string(size);
+        return res;
+    }
+
+    auto contentRange = [size](const std::pair<size_t, size_t>& range) {
+        return "bytes " + std::to_string(range.first) + "-" + std::to_string(range.second) + "/" + std::to_string(size);
+    };
+
+    std::vector<HttpResponse::FilePart> parts;
+    HttpResponse res{206};
+    res[HttpHeader::AcceptRanges] = "bytes";
+    res[HttpHeader::ETag] = file->etag();
+    res[HttpHeader::LastModified] = httpDate(file->modified());
+
+    if (ranges.size() == 1) {
+        res[HttpHeader::ContentType] = mimeType;
+        res[HttpHeader::ContentRange] = contentRange(ranges[0]);
+        parts.push_back({"", ranges[0].first, ranges[0].second - ranges[0].first + 1});
+    } else {
+        static thread_local std::mt19937_64 random{std::random_device{}()};
+
+        char boundary[32];
+        snprintf(boundary, sizeof(boundary), "%016llx", static_cast<unsigned long long>(random()));
+        res[HttpHeader::ContentType] = std::string("multipart/byteranges; boundary=") + boundary;
+
+        for (auto& range : ranges) {
+            std::string prefix = std::string("\r\n--") + boundary + "\r\nContent-Type: " + mimeType +
+                "\r\nContent-Range: " + contentRange(range) + "\r\n\r\n";
+            parts.push_back({std::move(prefix), range.first, range.second - range.first + 1});
+        }
+
+        parts.push_back({std::string("\r\n--") + boundary + "--\r\n", 0, 0});
+    }
+
+    res.setFile(std::move(file), std::move(parts));
+    return res;
+}
+
+/*static*/ std::optional<HttpResponse> HttpHandlerBuilder::cachedResponse(const HttpRequest& req, const std::string& path, HttpFileCache& cache) {
+    // ranges are sent from the file
+    if (req.getMethod() == HttpRequestMethod::GET && !req.header(HttpHeader::Range).empty())
+        return std::nullopt;
+
+    auto cached = cache.find(path);
+    if (!cached)
+        return std::nullopt;
+
+    if (isNotModified(req, cached->etag, cached->modified))
+        return notModified(cached->etag, cached->lastModified);
+
+    return HttpResponse{std::move(cached)};
+}
+
+/*static*/ HttpResponse HttpHandlerBuilder::fileResponse(const HttpRequest& req, const std::string& path, HttpFileCache* cache) {
+    // a revalidation is answered from the metadata, without opening the file
+    struct stat st;
+    bool regular = stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+    if (regular) {
+        std::string etag = fileETag(st);
+        if (isNotModified(req, etag, st.st_mtime))
+            return notModified(std::move(etag), httpDate(st.st_mtime));
+    }
+
+    std::string mimeType = getMimeType(path);
+    bool ranged = req.getMethod() == HttpRequestMethod::GET && !req.header(HttpHeader::Range).empty();
+
+    // files the cache would turn down go straight to sendfile
+    if (cache && !ranged && regular && static_cast<size_t>(st.st_size) <= cache->maxFileSize()) {
+        auto cached = cache->load(path, mimeType);
+        if (cached)
+            return HttpResponse{std::move(cached)};
+    }
+
+    auto file = HttpFileBody::open(path);
+    if (file) {
+        if (ranged) {
+            auto partial = rangeResponse(req, file, mimeType);
+            if (partial)
+                return std::move(*partial);
+        }
+
+        HttpResponse res{200, mimeType, file};
+        res[HttpHeader::AcceptRanges] = "bytes";
+        res[HttpHeader::ETag] = file->etag();
+        res[HttpHeader::LastModified] = httpDate(file->modified());
+        return res;
+    }
+
+    TINYHTTP_LOG_DEBUG("Could not locate file: %s", path.c_str());
+    return HttpResponse{404, "text/plain", "The requested file is missing from the server"};
+}
+
+/*static*/ bool HttpHandlerBuilder::isSafeFilename(const std::string& name, bool allowSlash) {
+    static const char allowedChars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.-+@";
+    for (auto x : name) {
+        if (x == '/' && !allowSlash)
+            return false;
+
+        bool ok = false;
+        for (size_t i = 0; allowedChars[i] && !ok; i++)
+            ok = allowedChars[i] == x;
+
+        if (!ok) return false;
+    }
+
+    return true;
+}
+
+/*static*/ std::string HttpHandlerBuilder::getMimeType(std::string name) {
+    static std::map<std::string, std::string> mMimeDatabase;
+
+    if (mMimeDatabase.empty()) {
+        mMimeDatabase.insert({"js",   "application/javascript"});
+        mMimeDatabase.insert({"pdf",  "application/pdf"});
+        mMimeDatabase.insert({"gz",   "application/gzip"});
+        mMimeDatabase.insert({"xml",  "application/xml"});
+        mMimeDatabase.insert({"html", "text/html"});
+        mMimeDatabase.insert({"htm",  "text/html"});
+        mMimeDatabase.insert({"css",  "text/css"});
+        mMimeDatabase.insert({"txt",  "text/plain"});
+        mMimeDatabase.insert({"png",  "image/png"});
+        mMimeDatabase.insert({"jpg",  "image/jpeg"});
+        mMimeDatabase.insert({"jpeg", "image/jpeg"});
+        mMimeDatabase.insert({"json", "application/json"});
+    }
+
+    size_t pos = name.rfind(".");
+    if (pos == std::string::npos)
+        return "application/octet-stream";
+
+    auto f = mMimeDatabase.find(name.substr(pos+1));
+    if (f == mMimeDatabase.end())
+        return "application/octet-stream";
+
+    return f->second;
+}
+
+// characters ending the literal prefix of a route pattern
+static constexpr std::string_view sRegexSpecial = "\\^$.|?*+()[]{}";
+
+void HttpRouter::add(std::string path, Handler handler, bool front) {
+    if (path.find("/:") == std::string::npos) {
+        auto& handlers = mExact[std::move(path)];
+        handlers.insert(front ? handlers.begin() : handlers.end(), std::move(handler));
+        return;
+    }
+
+    if (path[0] != '/')
+        throw std::runtime_error("routes with parameters have to start with '/'");
+
+    SegmentNode* node = &mSegments;
+    size_t pos = 1, count = 0;
+
+    while (pos <= path.size()) {
+        size_t end = path.find('/', pos);
+        if (end == std::string::npos)
+            end = path.size();
+
+        std::string_view segment = std::string_view{path}.substr(pos, end-pos);
+        pos = end+1;
+
+        if (segment.empty() || segment[0] != ':') {
+            auto& next = node->literals[std::string{segment}];
+            if (!next)
+                next = std::make_unique<SegmentNode>();
+
+            node = next.get();
+            continue;
+        }
+
+        // :name or :name<type>
+        std::string_view name = segment.substr(1);
+        ParamType type = ParamType::Segment;
+
+        size_t open = name.find('<');
+        if (open != std::string_view::npos) {
+            if (name.back() != '>')
+                throw std::runtime_error("unterminated path parameter type in " + path);
+
+            std::string_view typeName = name.substr(open+1, name.size()-open-2);
+            name = name.substr(0, open);
+
+            if (typeName == "int")
+                type = ParamType::Int;
+            else if (typeName == "uuid")
+                type = ParamType::Uuid;
+            else if (typeName == "slug")
+                type = ParamType::Slug;
+            else if (typeName == "path")
+                type = ParamType::Rest;
+            else
+                throw std::runtime_error("unknown path parameter type \"" + std::string{typeName} + "\" in " + path);
+        }
+
+        if (name.empty())
+            throw std::runtime_error("unnamed path parameter in " + path);
+
+        if (type == ParamType::Rest && end != path.size())
+            throw std::runtime_error("<path> parameters have to be the last segment in " + path);
+
+        if (++count > MAX_PATH_PARAMS)
+            throw std::runtime_error("too many path parameters in " + path);
+
+        auto p = std::find_if(node->params.begin(), node->params.end(), [&](const SegmentNode::Param& x) {
+            return x.type == type && x.name == name;
+        });
+
+        if (p == node->params.end()) {
+            node->params.push_back({type, std::string{name}, std::make_unique<SegmentNode>()});
+            p = node->params.end()-1;
+        }
+
+        node = p->next.get();
+    }
+
+    node->handlers.insert(front ? node->handlers.begin() : node->handlers.end(), std::move(handler));
+}
+
+void HttpRouter::addPattern(const std::string& pattern, Handler handler) {
+    Pattern p;
+    p.handler = std::move(handler);
+
+    // alternatives can start with anything, so those get no prefix at all
+    size_t pos = 0;
+    if (pattern.find('|') == std::string::npos) {
+        while (pos < pattern.size()) {
+            char c = pattern[pos];
+            size_t len = 1;
+
+            if (c == '\\') {
+                // escaped punctuation stands for itself, classes like \d or \w don't
+                if (pos+1 == pattern.size() || isalnum((unsigned char)pattern[pos+1]))
+                    break;
+
+                c = pattern[pos+1];
+                len = 2;
+            } else if (sRegexSpecial.find(c) != std::string_view::npos)
+                break;
+
+            // a quantified character may be missing from the path
+            if (pos+len < pattern.size() && std::string_view{"?*{"}.find(pattern[pos+len]) != std::string_view::npos)
+                break;
+
+            p.prefix += c;
+            pos += len;
+        }
+    }
+
+    std::string_view rest = std::string_view{pattern}.substr(pos);
+    if (rest.empty())
+        p.tail = Tail::Exact;
+    else if (rest == "[^/]+")
+        p.tail = Tail::Segment;
+    else if (rest == "[^/]*")
+        p.tail = Tail::OptSegment;
+    else if (rest == ".*")
+        p.tail = Tail::Any;
+    else if (rest == ".+")
+        p.tail = Tail::AnyNonEmpty;
+    else {
+        p.tail = Tail::Regex;
+        p.regex = std::regex{pattern};
+    }
+
+    // find or create the node of the prefix, splitting labels where it branches off
+    Node* node = &mRoot;
+    std::string_view key = p.prefix;
+
+    while (!key.empty()) {
+        Node* next = nullptr;
+
+        for (auto& child : node->children) {
+            if (child->label[0] != key[0])
+                continue;
+
+            size_t common = 1;
+            while (common < child->label.size() && common < key.size() && child->label[common] == key[common])
+                ++common;
+
+            if (common < child->label.size()) {
+                auto split = std::make_unique<Node>();
+                split->label = child->label.substr(0, common);
+                child->label.erase(0, common);
+                split->children.push_back(std::move(child));
+                child = std::move(split);
+            }
+
+            next = child.get();
+            key.remove_prefix(common);
+            break;
+        }
+
+        if (!next) {
+            node->children.push_back(std::make_unique<Node>());
+            next = node->children.back().get();
+            next->label = std::string{key};
+            key = {};
+        }
+
+        node = next;
+    }
+
+    node->patterns.push_back(mPatterns.size());
+    mPatterns.push_back(std::move(p));
+}
+
+size_t HttpRouter::collect(const std::string& path, size_t* out) const {
+    const Node* node = &mRoot;
+    size_t pos = 0, count = 0;
+
+    while (node) {
+        for (size_t i : node->patterns) {
+            if (count == sMaxCandidates)
+                return sMaxCandidates+1;
+
+            out[count++] = i;
+        }
+
+        const Node* next = nullptr;
+        if (pos < path.size()) {
+            for (auto& child : node->children)
+                if (child->label[0] == path[pos]) {
+                    if (path.compare(pos, child->label.size(), child->label) == 0) {
+                        next = child.get();
+                        pos += child->label.size();
+                    }
+
+                    break;
+                }
+        }
+
+        node = next;
+    }
+
+    // nodes are visited from the shortest prefix, restore the registration order
+    std::sort(out, out+count);
+    return count;
+}
+
+/*static*/ bool HttpRouter::paramMatches(ParamType type, std::string_view value) {
+    if (value.empty())
+        return false;
+
+    switch (type) {
+        case ParamType::Segment:
+        case ParamType::Rest:
+            return true;
+        case ParamType::Int: {
+            int64_t number;
+            auto res = std::from_chars(value.data(), value.data()+value.size(), number);
+            return res.ec == std::errc{} && res.ptr == value.data()+value.size();
+        }
+        case ParamType::Uuid:
+            if (value.size() != 36)
+                return false;
+
+            for (size_t i = 0; i < value.size(); ++i) {
+                if (i == 8 || i == 13 || i == 18 || i == 23) {
+                    if (value[i] != '-')
+                        return false;
+                } else if (!isxdigit((unsigned char)value[i]))
+                    return false;
+            }
+
+            return true;
+        case ParamType::Slug:
+            for (char c : value)
+                if (!isalnum((unsigned char)c) && c != '-' && c != '_')
+                    return false;
+
+            return true;
+    }
+
+    return false;
+}
+
+/*static*/ bool HttpRouter::matches(const Pattern& pattern, const std::string& path) {
+    std::string_view tail = std::string_view{path}.substr(pattern.prefix.size());
+
+    switch (pattern.tail) {
+        case Tail::Exact:
+            return tail.empty();
+        case Tail::Segment:
+            return !tail.empty() && tail.find('/') == std::string_view::npos;
+        case Tail::OptSegment:
+            return tail.find('/') == std::string_view::npos;
+        case Tail::AnyNonEmpty:
+            if (tail.empty())
+                return false;
+            [[fallthrough]];
+        case Tail::Any:
+            // '.' doesn't match line terminators
+            return tail.find_first_of("\r\n") == std::string_view::npos;
+        case Tail::Regex:
+            return std::regex_match(path, pattern.regex);
+    }
+
+    return false;
+}
+
+static_assert((TINYHTTP_LOG_BUFFER_SIZE & (TINYHTTP_LOG_BUFFER_SIZE - 1)) == 0, "TINYHTTP_LOG_BUFFER_SIZE must be a power of 2");
+static_assert(TINYHTTP_LOG_LINE_LENGTH < 0x10000 && TINYHTTP_LOG_LINE_LENGTH + 4 <= TINYHTTP_LOG_BUFFER_SIZE, "TINYHTTP_LOG_LINE_LENGTH is out of range");
+
+// Single producer, single consumer ring of log records: 2 bytes length, 1 byte level,
+// 1 byte padding, then the line. `head` is only written by the owning thread, `tail`
+// only by the thread draining it.
+struct HttpLogger::Ring {
+    char data[TINYHTTP_LOG_BUFFER_SIZE];
+    std::atomic<size_t> head{0}, tail{0};
+
+    void write(size_t pos, const void* from, size_t size) noexcept {
+        pos &= TINYHTTP_LOG_BUFFER_SIZE - 1;
+        size_t first = std::min(size, TINYHTTP_LOG_BUFFER_SIZE - pos);
+        memcpy(data + pos, from, first);
+        memcpy(data, static_cast<const char*>(from) + first, size - first);
+    }
+
+    void read(size_t pos, void* to, size_t size) const noexcept {
+        pos &= TINYHTTP_LOG_BUFFER_SIZE - 1;
+        size_t first = std::min(size, TINYHTTP_LOG_BUFFER_SIZE - pos);
+        memcpy(to, data + pos, first);
+        memcpy(static_cast<char*>(to) + first, data, size - first);
+    }
+};
+
+// a log line being formatted, cut at TINYHTTP_LOG_LINE_LENGTH
+struct LogLine {
+    char data[TINYHTTP_LOG_LINE_LENGTH];
+    size_t length = 0;
+
+    void append(std::string_view text) noexcept {
+        size_t n = std::min(text.size(), sizeof(data) - length);
+        memcpy(data + length, text.data(), n);
+        length += n;
+    }
+
+    void append(long long number) noexcept {
+        char digits[24];
+        auto res = std::to_chars(digits, digits + sizeof(digits), number);
+        append({digits, static_cast<size_t>(res.ptr - digits)});
+    }
+
+    // quotes and control characters are escaped, as \" and \xHH or \u00HH for JSON
+    void appendEscaped(std::string_view text, bool json) noexcept {
+        static const char hex[] = "0123456789abcdef";
+
+        for (unsigned char ch : text) {
+            if (ch == '"' || ch == '\\') {
+                char escaped[2] = {'\\', static_cast<char>(ch)};
+                append({escaped, 2});
+            } else if (ch < 0x20 || ch == 0x7F) {
+                char escaped[6] = {'\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xF]};
+                if (json)
+                    append({escaped, 6});
+                else {
+                    escaped[1] = 'x';
+                    append({escaped + 0, 2});
+                    append({escaped + 4, 2});
+                }
+            } else
+                append({reinterpret_cast<const char*>(&ch), 1});
+        }
+    }
+};
+
+// the current time in `format`, formatted at most once per second on each thread
+template<size_t Id>
+static std::string_view cachedTime(const char* format) {
+    thread_local time_t formatted = -1;
+    thread_local char text[64];
+    thread_local size_t length = 0;
+
+    time_t now = time(nullptr);
+    if (now != formatted) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        length = strftime(text, sizeof(text), format, &tm);
+        formatted = now;
+    }
+
+    return {text, length};
+}
+
+/*static*/ HttpLogger& HttpLogger::instance() {
+    static HttpLogger logger;
+    return logger;
+}
+
+HttpLogger::~HttpLogger() {
+    #ifdef TINYHTTP_THREADING
+    {
+        std::unique_lock<std::mutex> lock{mMutex};
+        mShutdown = true;
+    }
+
+    mWakeup.notify_all();
+    if (mWriterThread)
+        mWriterThread->join();
+
+    flush();
+
+    for (size_t i = 0; i <= TINYHTTP_LOG_RINGS; i++)
+        delete (i < TINYHTTP_LOG_RINGS ? mSlots[i] : mOverflow).ring.load(std::memory_order_acquire);
+    #endif
+}
+
+void HttpLogger::setSink(Sink sink) {
+    #ifdef TINYHTTP_THREADING
+    flush();
+    std::unique_lock<std::mutex> lock{mDrainMutex};
+    #endif
+
+    mSink = std::move(sink);
+}
+
+void HttpLogger::log(HttpLogLevel level, const char* format, ...) {
+    if (!enabled(level))
+        return;
+
+    char line[TINYHTTP_LOG_LINE_LENGTH];
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (length >= 0)
+        push(level, line, std::min<size_t>(length, sizeof(line) - 1));
+}
+
+void HttpLogger::access(const HttpRequest& req, std::string_view peer, unsigned statusCode, long long bytes) {
+    if (!enabled(HttpLogLevel::Info))
+        return;
+
+    thread_local unsigned requests = 0;
+    unsigned sampling = mSampling.load(std::memory_order_relaxed);
+    if (sampling > 1 && ++requests % sampling != 0)
+        return;
+
+    LogLine line;
+
+    if (mFormat.load(std::memory_order_relaxed) == HttpLogFormat::Json) {
+        line.append("{\"time\":\"");
+        line.append(cachedTime<0>("%Y-%m-%dT%H:%M:%SZ"));
+        line.append("\",\"remote\":\"");
+        line.appendEscaped(peer, true);
+        line.append("\",\"method\":\"");
+        line.appendEscaped(req.getMethodName(), true);
+        line.append("\",\"path\":\"");
+        line.appendEscaped(req.getPath(), true);
+        line.append("\",\"query\":\"");
+        line.appendEscaped(req.getQuery(), true);
+        line.append("\",\"status\":");
+        line.append(static_cast<long long>(statusCode));
+        line.append(",\"bytes\":");
+        if (bytes >= 0)
+            line.append(bytes);
+        else
+            line.append("null");
+        line.append(",\"referer\":\"");
+        line.appendEscaped(req.header("Referer"), true);
+        line.append("\",\"user_agent\":\"");
+        line.appendEscaped(req.header(HttpHeader::UserAgent), true);
+        line.append("\"}");
+    } else {
+        // 127.0.0.1 - - [10/Oct/2000:13:55:36 +0000] "GET / HTTP/1.1" 200 2326
+        line.append(peer);
+        line.append(" - - [");
+        line.append(cachedTime<1>("%d/%b/%Y:%H:%M:%S +0000"));
+        line.append("] \"");
+        line.appendEscaped(req.requestLine(), false);
+        line.append("\" ");
+        line.append(static_cast<long long>(statusCode));
+        line.append(" ");
+        if (bytes >= 0)
+            line.append(bytes);
+        else
+            line.append("-");
+
+        if (mFormat.load(std::memory_order_relaxed) == HttpLogFormat::Combined) {
+            auto quoted = [&](std::string_view value) {
+                line.append(" \"");
+                if (value.empty())
+                    line.append("-");
+                else
+                    line.appendEscaped(value, false);
+                line.append("\"");
+            };
+
+            quoted(req.header("Referer"));
+            quoted(req.header(HttpHeader::UserAgent));
+        }
+    }
+
+    push(HttpLogLevel::Info, line.data, line.length);
+}
+
+// writes the whole buffer to `fd`, giving up on errors
+static void writeLogOutput(int fd, std::string& buffer) {
+    size_t done = 0;
+
+    while (done < buffer.size()) {
+        ssize_t len = ::write(fd, buffer.data() + done, buffer.size() - done);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+
+        done += len;
+    }
+
+    buffer.clear();
+}
+
+#ifdef TINYHTTP_THREADING
+HttpLogger::Slot& HttpLogger::claimSlot() {
+    thread_local Claim claim;
+
+    // threads start looking at different slots, so claiming one rarely has to skip any
+    size_t start = mNextSlot.fetch_add(1, std::memory_order_relaxed);
+
+    for (size_t i = 0; i < TINYHTTP_LOG_RINGS; i++) {
+        Slot& slot = mSlots[(start + i) % TINYHTTP_LOG_RINGS];
+        if (slot.claimed.load(std::memory_order_relaxed) || slot.claimed.exchange(true, std::memory_order_acquire))
+            continue;
+
+        claim.slot = &slot;
+        sSlot = &slot;
+        return slot;
+    }
+
+    sSlot = &mOverflow;
+    return mOverflow;
+}
+
+// only called by the thread holding the slot, or with mOverflowMutex for the shared one
+HttpLogger::Ring& HttpLogger::ringOf(Slot& slot) {
+    if (Ring* ring = slot.ring.load(std::memory_order_relaxed))
+        return *ring;
+
+    Ring* ring = new Ring();
+    slot.ring.store(ring, std::memory_order_release);
+
+    std::unique_lock<std::mutex> lock{mMutex};
+    if (!mWriterThread && !mShutdown)
+        mWriterThread.reset(new std::thread{[this]() { this->writerThreadProc(); }});
+
+    return *ring;
+}
+
+void HttpLogger::push(HttpLogLevel level, const char* line, size_t length) {
+    Slot& slot = sSlot ? *sSlot : claimSlot();
+
+    if (&slot != &mOverflow) {
+        pushInto(ringOf(slot), level, line, length);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock{mOverflowMutex};
+    pushInto(ringOf(slot), level, line, length);
+}
+
+void HttpLogger::pushInto(Ring& ring, HttpLogLevel level, const char* line, size_t length) {
+    size_t head = ring.head.load(std::memory_order_relaxed);
+    size_t tail = ring.tail.load(std::memory_order_acquire);
+
+    if (TINYHTTP_LOG_BUFFER_SIZE - (head - tail) < length + 4) {
+        mDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    uint8_t header[4] = {static_cast<uint8_t>(length), static_cast<uint8_t>(length >> 8), static_cast<uint8_t>(level), 0};
+    ring.write(head, header, sizeof(header));
+    ring.write(head + sizeof(header), line, length);
+    ring.head.store(head + sizeof(header) + length, std::memory_order_release);
+
+    // the writer is woken early once the ring gets half full
+    constexpr size_t half = TINYHTTP_LOG_BUFFER_SIZE / 2;
+    if (head - tail < half && head + sizeof(header) + length - tail >= half)
+        mWakeup.notify_one();
+}
+
+void HttpLogger::writerThreadProc() {
+    std::unique_lock<std::mutex> lock{mMutex};
+
+    while (!mShutdown) {
+        mWakeup.wait_for(lock, std::chrono::milliseconds(50));
+
+        lock.unlock();
+        flush();
+        lock.lock();
+    }
+}
+
+void HttpLogger::flush() {
+    std::unique_lock<std::mutex> drainLock{mDrainMutex};
+    char line[TINYHTTP_LOG_LINE_LENGTH];
+
+    for (size_t i = 0; i <= TINYHTTP_LOG_RINGS; i++) {
+        Ring* ring = (i < TINYHTTP_LOG_RINGS ? mSlots[i] : mOverflow).ring.load(std::memory_order_acquire);
+        if (!ring)
+            continue;
+
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        size_t head = ring->head.load(std::memory_order_acquire);
+
+        while (tail != head) {
+            uint8_t header[4];
+            ring->read(tail, header, sizeof(header));
+
+            size_t length = header[0] | (header[1] << 8);
+            auto level = static_cast<HttpLogLevel>(header[2]);
+            ring->read(tail + sizeof(header), line, length);
+            tail += sizeof(header) + length;
+
+            if (mSink) {
+                mSink(level, {line, length});
+            } else {
+                std::string& out = level == HttpLogLevel::Error ? mErr : mOut;
+                out.append(line, length);
+                out += '\n';
+            }
+        }
+
+        ring->tail.store(tail, std::memory_order_release);
+    }
+
+    writeLogOutput(STDOUT_FILENO, mOut);
+    writeLogOutput(STDERR_FILENO, mErr);
+}
+#else
+void HttpLogger::push(HttpLogLevel level, const char* line, size_t length) {
+    if (mSink) {
+        mSink(level, {line, length});
+        return;
+    }
+
+    std::string out{line, length};
+    out += '\n';
+    writeLogOutput(level == HttpLogLevel::Error ? STDERR_FILENO : STDOUT_FILENO, out);
+}
+
+void HttpLogger::flush() {}
+#endif
+
+#ifdef TINYHTTP_METRICS
+/*static*/ HttpMetrics& HttpMetrics::instance() {
+    static HttpMetrics metrics;
+    return metrics;
+}
+
+HttpMetrics::HttpMetrics()
+    : mRoutes{"other"} {}
+
+HttpMetrics::~HttpMetrics() {
+    for (auto& slot : mSlots)
+        delete slot.shard.load(std::memory_order_acquire);
+}
+
+void HttpMetrics::Shard::addTo(Shard& total) const noexcept {
+    total.bytesIn.add(bytesIn.get());
+    total.bytesOut.add(bytesOut.get());
+    total.connectionsOpened.add(connectionsOpened.get());
+    total.connectionsClosed.add(connectionsClosed.get());
+    total.handoversStarted.add(handoversStarted.get());
+    total.handoversEnded.add(handoversEnded.get());
+    total.parseErrors.add(parseErrors.get());
+    total.notFound.add(notFound.get());
+
+    for (size_t i = 0; i < 3; i++)
+        total.shed[i].add(shed[i].get());
+
+    for (size_t i = 0; i < TINYHTTP_METRICS_MAX_ROUTES; i++) {
+        const Route& from = routes[i];
+        Route& to = total.routes[i];
+
+        for (size_t m = 0; m < sMethods; m++)
+            for (size_t c = 0; c < sStatusClasses; c++)
+                to.requests[m][c].add(from.requests[m][c].get());
+
+        for (size_t b = 0; b < sLatencyBuckets; b++)
+            to.latency[b].add(from.latency[b].get());
+
+        to.latencySum.add(from.latencySum.get());
+    }
+}
+
+HttpMetrics::Shard& HttpMetrics::claimShard() {
+    thread_local Claim claim;
+
+    // threads start looking at different slots, so claiming one rarely has to skip any
+    size_t start = mNextSlot.fetch_add(1, std::memory_order_relaxed);
+
+    for (size_t i = 0; i < TINYHTTP_METRICS_SHARDS; i++) {
+        Slot& slot = mSlots[(start + i) % TINYHTTP_METRICS_SHARDS];
+        if (slot.claimed.load(std::memory_order_relaxed) || slot.claimed.exchange(true, std::memory_order_acquire))
+            continue;
+
+        Shard* shard = slot.shard.load(std::memory_order_relaxed);
+        if (!shard) {
+            shard = new Shard();
+            slot.shard.store(shard, std::memory_order_release);
+        }
+
+        claim.slot = &slot;
+        sShard = shard;
+        return *shard;
+    }
+
+    // more threads count than there are shards, this one shares the overflow shard
+    sShared = true;
+    sShard = &mOverflow;
+    return mOverflow;
+}
+
+size_t HttpMetrics::route(const std::string& label) {
+    #ifdef TINYHTTP_THREADING
+    std::unique_lock<std::mutex> lock{mMutex};
+    #endif
+
+    auto it = std::find(mRoutes.begin(), mRoutes.end(), label);
+    if (it != mRoutes.end())
+        return it - mRoutes.begin();
+
+    if (mRoutes.size() >= TINYHTTP_METRICS_MAX_ROUTES)
+        return 0;
+
+    mRoutes.push_back(label);
+    return mRoutes.size() - 1;
+}
+
+// latency bucket of a request taking `us` microseconds, see HttpMetrics::sLatencyBuckets
+static size_t latencyBucket(uint64_t us) noexcept {
+    // bucket i holds (bound(i-1), bound(i)], so it's looked up by the value below
+    uint64_t x = us > 0 ? us - 1 : 0;
+    if (x < 2)
+        return x;
+
+    unsigned e = 63 - __builtin_clzll(x);
+    size_t index = 2 + (e - 1) * 2 + ((x >> (e - 1)) & 1);
+    return std::min(index, HttpMetrics::sLatencyBuckets - 1);
+}
+
+// inclusive upper bound of a latency bucket in microseconds, the first value of the next one
+static uint64_t latencyBucketBound(size_t index) noexcept {
+    size_t next = index + 1;
+    if (next < 2)
+        return next;
+
+    unsigned e = (next - 2) / 2 + 1;
+    return static_cast<uint64_t>(2 + (next - 2) % 2) << (e - 1);
+}
+
+void HttpMetrics::request(size_t route, HttpRequestMethod method, unsigned statusCode, std::chrono::steady_clock::duration elapsed) {
+    Route& r = shard().routes[route < TINYHTTP_METRICS_MAX_ROUTES ? route : 0];
+
+    size_t statusClass = std::min(std::max(statusCode / 100, 1u), 5u) - 1;
+    r.requests[static_cast<size_t>(method)][statusClass].add(1);
+
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    r.latency[latencyBucket((ns + 999) / 1000)].add(1);
+    r.latencySum.add(ns);
+}
+
+static constexpr const char* sMethodNames[] = {"GET", "POST", "PUT", "DELETE", "OPTIONS", "UNKNOWN"};
+
+// route label with '\', '"' and newlines escaped
+static void appendLabel(std::string& out, std::string_view value) {
+    for (char ch : value) {
+        if (ch == '\\' || ch == '"') {
+            out += '\\';
+            out += ch;
+        } else if (ch == '\n') {
+            out += "\\n";
+        } else {
+            out += ch;
+        }
+    }
+}
+
+static void appendMetricHeader(std::string& out, const char* name, const char* type, const char* help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+static void appendMetric(std::string& out, const char* name, const char* type, const char* help, long long value) {
+    appendMetricHeader(out, name, type, help);
+    out += name;
+    out += ' ';
+    out += std::to_string(value);
+    out += '\n';
+}
+
+void HttpMetrics::render(std::string& out) {
+    auto total = std::make_unique<Shard>();
+    std::vector<std::string> routes;
+
+    mOverflow.addTo(*total);
+    for (auto& slot : mSlots)
+        if (Shard* shard = slot.shard.load(std::memory_order_acquire))
+            shard->addTo(*total);
+
+    {
+        #ifdef TINYHTTP_THREADING
+        std::unique_lock<std::mutex> lock{mMutex};
+        #endif
+        routes = mRoutes;
+    }
+
+    char number[64];
+
+    appendMetricHeader(out, "tinyhttp_requests_total", "counter", "Requests answered by a route.");
+    for (size_t i = 0; i < routes.size(); i++) {
+        for (size_t m = 0; m < sMethods; m++) {
+            for (size_t c = 0; c < sStatusClasses; c++) {
+                uint64_t count = total->routes[i].requests[m][c].get();
+                if (count == 0)
+                    continue;
+
+                out += "tinyhttp_requests_total{route=\"";
+                appendLabel(out, routes[i]);
+                snprintf(number, sizeof(number), "\",method=\"%s\",status=\"%zuxx\"} %llu\n", sMethodNames[m], c + 1, static_cast<unsigned long long>(count));
+                out += number;
+            }
+        }
+    }
+
+    appendMetricHeader(out, "tinyhttp_request_duration_seconds", "histogram", "Time spent in the handler of a route.");
+    for (size_t i = 0; i < routes.size(); i++) {
+        const Route& r = total->routes[i];
+
+        uint64_t count = 0;
+        for (size_t b = 0; b < sLatencyBuckets; b++)
+            count += r.latency[b].get();
+
+        if (count == 0)
+            continue;
+
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b < sLatencyBuckets; b++) {
+            cumulative += r.latency[b].get();
+
+            out += "tinyhttp_request_duration_seconds_bucket{route=\"";
+            appendLabel(out, routes[i]);
+
+            if (b + 1 < sLatencyBuckets)
+                snprintf(number, sizeof(number), "\",le=\"%.6f\"} %llu\n", latencyBucketBound(b) / 1e6, static_cast<unsigned long long>(cumulative));
+            else
+                snprintf(number, sizeof(number), "\",le=\"+Inf\"} %llu\n", static_cast<unsigned long long>(cumulative));
+
+            out += number;
+        }
+
+        out += "tinyhttp_request_duration_seconds_sum{route=\"";
+        appendLabel(out, routes[i]);
+        snprintf(number, sizeof(number), "\"} %.9f\n", r.latencySum.get() / 1e9);
+        out += number;
+
+        out += "tinyhttp_request_duration_seconds_count{route=\"";
+        appendLabel(out, routes[i]);
+        snprintf(number, sizeof(number), "\"} %llu\n", static_cast<unsigned long long>(count));
+        out += number;
+    }
+
+    // the shards are read one by one, so a close may be seen without its open
+    long long active = total->connectionsOpened.get() - total->connectionsClosed.get();
+    long long handovers = total->handoversStarted.get() - total->handoversEnded.get();
+
+    appendMetric(out, "tinyhttp_not_found_total", "counter", "Requests no route answered.", total->notFound.get());
+    appendMetric(out, "tinyhttp_parse_errors_total", "counter", "Requests rejected with 400 Bad Request.", total->parseErrors.get());
+    appendMetricHeader(out, "tinyhttp_shed_connections_total", "counter", "Connections answered with 503 Service Unavailable and closed.");
+    static constexpr const char* shedReasons[] = {"max_connections", "max_per_client", "queue_full"};
+    for (size_t i = 0; i < 3; i++) {
+        snprintf(number, sizeof(number), "tinyhttp_shed_connections_total{reason=\"%s\"} %llu\n", shedReasons[i], static_cast<unsigned long long>(total->shed[i].get()));
+        out += number;
+    }
+
+    appendMetric(out, "tinyhttp_received_bytes_total", "counter", "Bytes read from clients.", total->bytesIn.get());
+    appendMetric(out, "tinyhttp_sent_bytes_total", "counter", "Bytes written to clients.", total->bytesOut.get());
+    appendMetric(out, "tinyhttp_connections_total", "counter", "Accepted connections.", total->connectionsOpened.get());
+    appendMetric(out, "tinyhttp_connections_active", "gauge", "Open client connections.", std::max(active, 0ll));
+    appendMetric(out, "tinyhttp_handovers_total", "counter", "Connections handed over to another protocol.", total->handoversStarted.get());
+    appendMetric(out, "tinyhttp_handovers_active", "gauge", "Connections currently served by a protocol handover.", std::max(handovers, 0ll));
+}
+
+HttpHandlerBuilder* HttpHandlerBuilder::serveMetrics() {
+    return requested([](const HttpRequest&, HttpResponse& res) {
+        std::string body;
+        HttpMetrics::instance().render(body);
+
+        res[HttpHeader::ContentType] = "text/plain; version=0.0.4";
+        res.setContent(std::move(body));
+    });
+}
+#else
+HttpHandlerBuilder* HttpHandlerBuilder::serveMetrics() {
+    return requested([](const HttpRequest& req) {
+        return HttpResponse{404, "text/plain", "metrics are disabled"};
+    });
+}
+#endif
+
+// body of the default 404 message, its size goes to the access log
+static constexpr std::string_view sNotFoundBody = "404 not found";
+
+// access log line of a handled request, compiled out below TINYHTTP_LOG_LEVEL 2
+static inline void logAccess(const HttpRequest& req, std::string_view peer, unsigned statusCode, long long bytes) {
+    if constexpr (TINYHTTP_LOG_LEVEL >= 2)
+        HttpLogger::instance().access(req, peer, statusCode, bytes);
+}
+
+void HttpTimerWheel::Timer::unlink() noexcept {
+    mPrev->mNext = mNext;
+    mNext->mPrev = mPrev;
+    mPrev = mNext = nullptr;
+}
+
+HttpTimerWheel::HttpTimerWheel(Clock::duration resolution)
+    : mResolution{resolution}, mStart{Clock::now()} {
+    for (auto& level : mSlots)
+        for (auto& head : level)
+            head.mPrev = head.mNext = &head;
+}
+
+HttpTimerWheel::~HttpTimerWheel() {
+    for (auto& level : mSlots) {
+        for (auto& head : level) {
+            while (head.mNext != &head) {
+                Timer& t = *head.mNext;
+                t.unlink();
+                t.mWheel = nullptr;
+            }
+        }
+    }
+}
+
+void HttpTimerWheel::insert(Timer& t) noexcept {
+    uint64_t delta = t.mExpires > mNow ? t.mExpires - mNow : 0;
+
+    unsigned level = 0;
+    while (level + 1 < sLevels && delta >= (uint64_t{1} << ((level + 1) * sLevelBits)))
+        level++;
+
+    // beyond the range of the last level, it's put back when that slot cascades
+    uint64_t expires = t.mExpires;
+    if (delta >= (uint64_t{1} << (sLevels * sLevelBits)))
+        expires = mNow + (uint64_t{1} << (sLevels * sLevelBits)) - 1;
+
+    Timer& head = mSlots[level][(expires >> (level * sLevelBits)) & (sSlots - 1)];
+    t.mPrev = head.mPrev;
+    t.mNext = &head;
+    head.mPrev->mNext = &t;
+    head.mPrev = &t;
+}
+
+void HttpTimerWheel::cascade(unsigned level) noexcept {
+    if (level >= sLevels)
+        return;
+
+    size_t slot = (mNow >> (level * sLevelBits)) & (sSlots - 1);
+    if (slot == 0)
+        cascade(level + 1);
+
+    Timer& head = mSlots[level][slot];
+    while (head.mNext != &head) {
+        Timer& t = *head.mNext;
+        t.unlink();
+        insert(t);
+    }
+}
+
+void HttpTimerWheel::arm(Timer& t, Clock::time_point when) noexcept {
+    cancel(t);
+
+    // rounded up, a timer never fires early
+    uint64_t tick = 0;
+    if (when > mStart)
+        tick = (when - mStart + mResolution - Clock::duration{1}) / mResolution;
+
+    t.mExpires = std::max(tick, mNow + 1);
+    t.mWheel = this;
+    insert(t);
+    mCount++;
+}
+
+void HttpTimerWheel::cancel(Timer& t) noexcept {
+    if (!t.mWheel)
+        return;
+
+    t.unlink();
+    t.mWheel = nullptr;
+    mCount--;
+}
+
+std::chrono::milliseconds HttpTimerWheel::nextTimeout(Clock::time_point now) const noexcept {
+    if (mCount == 0)
+        return std::chrono::milliseconds{-1};
+
+    // the upper levels are looked at again when the first level wraps around
+    uint64_t ticks = sSlots - (mNow & (sSlots - 1));
+    for (uint64_t i = 1; i < ticks; i++) {
+        const Timer& head = mSlots[0][(mNow + i) & (sSlots - 1)];
+        if (head.mNext != &head) {
+            ticks = i;
+            break;
+        }
+    }
+
+    auto wait = mStart + mResolution * (mNow + ticks) - now;
+    if (wait <= Clock::duration::zero())
+        return std::chrono::milliseconds{0};
+
+    return std::chrono::ceil<std::chrono::milliseconds>(wait);
+}
+
+// ticks of the timer wheels timing out connections
+static constexpr std::chrono::milliseconds sTimerResolution{100};
+
+// `seconds` from `from`, max() if the timeout is disabled
+static std::chrono::steady_clock::time_point timeoutAfter(std::chrono::steady_clock::time_point from, int seconds) noexcept {
+    if (seconds <= 0)
+        return std::chrono::steady_clock::time_point::max();
+
+    return from + std::chrono::seconds(seconds);
+}
+
+// Processor driving the current thread, lets a handler shut the server down without cutting off its own response
+static thread_local const void* sCurrentProcessor = nullptr;
+
+#ifdef TINYHTTP_EPOLL
+// CPUs of the process before any event loop was pinned
+static cpu_set_t sProcessCpus;
+static std::atomic<bool> sLoopsPinned{false};
+#endif
+
+#ifdef TINYHTTP_THREADING
+// threads started by a pinned event loop would inherit its CPU, give them the whole process mask back
+static void unpinThread() noexcept {
+    #ifdef TINYHTTP_EPOLL
+    if (sLoopsPinned.load(std::memory_order_relaxed))
+        pthread_setaffinity_np(pthread_self(), sizeof(sProcessCpus), &sProcessCpus);
+    #endif
+}
+#endif
+
+HttpServer::Processor::Processor(std::shared_ptr<IClientStream> stream, HttpServer& owner)
+    : mClientStream{std::move(stream)}, mOwner{owner}, mIsAlive{true} { }
+
+// pipelined responses queued at most before writing them
+static constexpr size_t sMaxPipelinedResponses = 32;
+
+bool HttpServer::Processor::hasBufferedRequest() {
+    StreamBuffer* buffer = mClientStream->readBuffer();
+    if (!buffer || buffer->empty())
+        return false;
+
+    // a malformed head counts too, its 400 doesn't have to wait for anything either
+    HttpRequestParser probe;
+    return probe.parse(buffer->data(), buffer->size()) != HttpRequestParser::Status::Incomplete;
+}
+
+#ifdef TINYHTTP_THREADING
+bool HttpServer::Processor::waitsForClient() {
+    if (mPoolSocket < 0)
+        return false;
+
+    // the rest of a started head is expected right away
+    StreamBuffer* buffer = mClientStream->readBuffer();
+    if (buffer && !buffer->empty())
+        return false;
+
+    // nothing to wait for if the client was quicker, or is gone
+    struct pollfd pfd = {mPoolSocket, POLLIN, 0};
+    return poll(&pfd, 1, 0) == 0;
+}
+#endif
+
+bool HttpServer::Processor::waitForRequest() {
+    StreamBuffer* buffer = mClientStream->readBuffer();
+    if (buffer && buffer->empty() && mClientStream->fillReadBuffer() == 0)
+        return false;
+
+    // from here on the rest of the head has to arrive in time
+    mClientStream->touch();
+    mPhase = Phase::Head;
+    return true;
+}
+
+bool HttpServer::keepConnection(const HttpRequest& req, HttpResponse* res, size_t served) const {
+    #ifdef TINYHTTP_ALLOW_KEEPALIVE
+    bool keep = req.keepAlive() && (mMaxRequestsPerConnection == 0 || served < mMaxRequestsPerConnection);
+    #else
+    bool keep = false;
+    #endif
+
+    if (!res)
+        return keep;
+
+    bool http10 = req.versionMajor() == 1 && req.versionMinor() == 0;
+
+    // HTTP/1.0 clients don't know chunked encoding, the end of the connection ends the body for them
+    if (http10 && res->isChunked()) {
+        (*res)[HttpHeader::TransferEncoding] = "";
+        keep = false;
+    }
+
+    // a Connection set by the handler (or for an unread body) is kept as it is
+    std::string& connection = (*res)[HttpHeader::Connection];
+    if (!connection.empty())
+        return keep && !hasToken(connection, "close");
+
+    if (!keep)
+        connection = "close";
+    else if (http10)
+        connection = "keep-alive";
+
+    return keep;
+}
+
+const MessageBuilder& HttpServer::notFoundMessage(const HttpRequest& req, bool keep) const {
+    if (!keep)
+        return mDefault404CloseMessage;
+
+    // HTTP/1.0 connections only stay open when told so
+    if (req.versionMajor() == 1 && req.versionMinor() == 0)
+        return mDefault404KeepAliveMessage;
+
+    return mDefault404Message;
+}
+
+void HttpServer::Processor::rejectRequest(OutputQueue& output, const MessageBuilder& message) {
+    output.push(message.data(), message.size());
+    output.flush(*mClientStream);
+    mClientStream->close();
+}
+
+/* static */ bool HttpServer::Processor::clientThreadProc(std::shared_ptr<Processor> self) {
+    ICanRequestProtocolHandover* handover = nullptr;
+    std::unique_ptr<HttpRequest> handoverRequest;
+    OutputQueue& output = self->mOutput;
+    size_t queuedResponses = 0;
+    sCurrentProcessor = self.get();
+
+    HttpRequest& req = self->mRequest;
+    HttpResponse& res = self->mResponse;
+
+    try {
+        while (self->mClientStream->isOpen() && self->isAlive()) {
+            // Responses of pipelined requests are queued as long as the next request is
+            // already buffered, then written together before waiting for the client
+            if (!output.empty() && (queuedResponses >= sMaxPipelinedResponses || !self->hasBufferedRequest())) {
+                output.flush(*self->mClientStream);
+                queuedResponses = 0;
+            }
+
+            #ifdef TINYHTTP_THREADING
+            // a pooled connection lets its worker go while the client thinks about its next request
+            if (!self->mPendingRequest && output.empty() && self->waitsForClient()) {
+                sCurrentProcessor = nullptr;
+                return true;
+            }
+            #endif
+
+            if (!self->mPendingRequest && !self->waitForRequest())
+                break;
+
+            std::optional<HttpBodyReader> body;
+
+            try {
+                if (self->mPendingRequest) {
+                    req = std::move(*self->mPendingRequest);
+                    self->mPendingRequest.reset();
+                } else if (!req.parseHead(self->mClientStream)) {
+                    TINYHTTP_METRIC(parseError());
+                    self->rejectRequest(output, self->mOwner.mDefault400Message);
+                    continue;
+                }
+
+                self->mClientStream->touch();
+                self->mPhase = Phase::Idle;
+
+                // reading the body may wait for the client, or send a 100 Continue
+                if (req.hasBody())
+                    output.flush(*self->mClientStream);
+
+                // the route decides whether the body is streamed to the handler or read here
+                size_t limit = req.hasBody() ? self->mOwner.streamingBodyLimit(req.getPath(), req) : 0;
+                body.emplace(*self->mClientStream, req, limit > 0 ? limit : MAX_HTTP_CONTENT_SIZE);
+
+                if (limit == 0 && !body->limitExceeded() && !body->finished())
+                    req.receiveContent(*body);
+            } catch (...) {
+                if (body && body->limitExceeded()) {
+                    self->rejectRequest(output, self->mOwner.mDefault413Message);
+                } else {
+                    TINYHTTP_METRIC(parseError());
+                    self->rejectRequest(output, self->mOwner.mDefault400Message);
+                }
+
+                continue;
+            }
+
+            if (body->limitExceeded()) {
+                self->rejectRequest(output, self->mOwner.mDefault413Message);
+                continue;
+            }
+
+            req.attachBodyReader(&*body);
+            bool found = self->mOwner.processRequest(req.getPath(), req, res);
+            req.attachBodyReader(nullptr);
+
+            if (body->limitExceeded()) {
+                self->rejectRequest(output, self->mOwner.mDefault413Message);
+                continue;
+            }
+
+            queuedResponses++;
+            bool keep;
+
+            if (found) {
+                // the rest of an unread body is not waited for
+                if (!body->finished())
+                    res[HttpHeader::Connection] = "close";
+
+                keep = self->mOwner.keepConnection(req, &res, ++self->mServed);
+                res.moveInto(output);
+                logAccess(req, self->mClientStream->peerAddress(), res.statusCode(), res.contentLength());
+
+                if (res.acceptProtocolHandover(&handover)) {
+                    handoverRequest = std::make_unique<HttpRequest>(req);
+                    break;
+                }
+
+                goto keep_alive_check;
+            }
+
+            keep = self->mOwner.keepConnection(req, nullptr, ++self->mServed);
+            {
+                const MessageBuilder& notFound = self->mOwner.notFoundMessage(req, keep);
+                output.push(notFound.data(), notFound.size());
+            }
+            logAccess(req, self->mClientStream->peerAddress(), 404, sNotFoundBody.size());
+
+            keep_alive_check:
+            if (!body->finished())
+                break;
+
+            self->mClientStream->touch();
+            self->mPhase = Phase::Idle;
+
+            if (!keep)
+                break;
+        }
+
+        output.flush(*self->mClientStream);
+
+        if (handover)
+            self->runHandover(handover, std::move(handoverRequest));
+    } catch (std::exception& e) {
+        // Don't print the exception when we are getting shut down, it's expected to be raised
+        if (self->isAlive()) {
+            TINYHTTP_LOG_ERROR("Exception in HTTP client handler (%s)", e.what());
+        }
+    }
+
+    self->mClientStream->close();
+    self->mIsAlive = false;
+    sCurrentProcessor = nullptr;
+
+    #ifdef TINYHTTP_THREADING
+    self->mOwner.untrackProcessor(self);
+    #endif
+
+    return false;
+}
+
+void HttpServer::Processor::runHandover(ICanRequestProtocolHandover* handover, std::unique_ptr<HttpRequest> request) {
+    TINYHTTP_LOG_DEBUG("Doing handover");
+    mClientStream->touch();
+    mPhase = Phase::Handover;
+    TINYHTTP_METRIC(handoverStarted());
+
+    try {
+        handover->acceptHandover(mOwner.mSocket, *mClientStream.get(), std::move(request));
+    } catch (...) {
+        TINYHTTP_METRIC(handoverEnded());
+        throw;
+    }
+
+    TINYHTTP_METRIC(handoverEnded());
+    TINYHTTP_LOG_DEBUG("Handover proc exited");
+}
+
+HttpTimerWheel::Clock::time_point HttpServer::Processor::deadline() const noexcept {
+    auto lastActive = mClientStream->lastActive();
+
+    switch (mPhase.load(std::memory_order_relaxed)) {
+        case Phase::Head:
+            return timeoutAfter(lastActive, TINYHTTP_HEADER_TIMEOUT);
+        case Phase::Idle:
+            return timeoutAfter(lastActive, mOwner.mIdleTimeout);
+        default:
+            return timeoutAfter(lastActive, TINYHTTP_WS_IDLE_TIMEOUT);
+    }
+}
+
+void HttpServer::Processor::shutdown() {
+    #ifdef TINYHTTP_THREADING
+    std::unique_lock<std::mutex> lock{mShutdownMutex};
+    #endif
+
+    mIsAlive = false;
+
+    #ifdef TINYHTTP_THREADING
+    // a worker picks the connection up and closes it
+    if (mParked && mOwner.resumeProcessor(this))
+        return;
+    #endif
+
+    // when called from one of our own handlers, the connection is closed after the response is sent
+    if (mClientStream && mClientStream->isOpen() && sCurrentProcessor != this)
+        mClientStream->close();
+
+    #ifdef TINYHTTP_THREADING
+    if (mWorkThread && mWorkThread->joinable())
+        mWorkThread->detach();
+    #endif
+}
+
+#ifdef TINYHTTP_THREADING
+void HttpServer::Processor::startThread() {
+    auto self_ptr = shared_from_this();
+    mWorkThread.reset(new std::thread{[self_ptr]() {
+        unpinThread();
+        clientThreadProc(self_ptr);
+    }});
+}
+
+void HttpServer::Processor::startHandoverThread(ICanRequestProtocolHandover* handover, std::unique_ptr<HttpRequest> request) {
+    auto self_ptr = shared_from_this();
+    mPhase = Phase::Handover;
+    mWorkThread.reset(new std::thread{[self_ptr, handover, req = std::move(request)]() mutable {
+        unpinThread();
+        sCurrentProcessor = self_ptr.get();
+
+        try {
+            self_ptr->runHandover(handover, std::move(req));
+        } catch (std::exception& e) {
+            if (self_ptr->isAlive()) {
+                TINYHTTP_LOG_ERROR("Exception in HTTP client handler (%s)", e.what());
+            }
+        }
+
+        self_ptr->mClientStream->close();
+        self_ptr->mIsAlive = false;
+        self_ptr->mOwner.untrackProcessor(self_ptr);
+    }});
+}
+
+void HttpServer::workerThreadProc() {
+    while (true) {
+        std::unique_lock<std::mutex> lock{mWorkerQueueMutex};
+        mWorkerQueueNotEmpty.wait(lock, [this]() { return mWorkersShutdown || !mWorkerQueue.empty(); });
+
+        if (mWorkersShutdown)
+            return;
+
+        auto processor = std::move(mWorkerQueue.front());
+        mWorkerQueue.pop_front();
+        lock.unlock();
+
+        mWorkerQueueNotFull.notify_one();
+
+        // the connection comes back when it has to wait for its client, the idle poller takes over then
+        while (Processor::clientThreadProc(processor) && !parkProcessor(processor)) {}
+    }
+}
+
+bool HttpServer::enqueueProcessor(std::shared_ptr<Processor> processor, bool resumed) {
+    std::unique_lock<std::mutex> lock{mWorkerQueueMutex};
+
+    if (!resumed && mOverloadPolicy == HttpOverloadPolicy::Block) {
+        mWorkerQueueNotFull.wait(lock, [this]() {
+            return mWorkersShutdown || mSocket == -1 || mWorkerQueue.size() < mWorkerQueueLength;
+        });
+    }
+
+    if (mWorkersShutdown || (!resumed && mWorkerQueue.size() >= mWorkerQueueLength))
+        return false;
+
+    mWorkerQueue.push_back(std::move(processor));
+    lock.unlock();
+
+    mWorkerQueueNotEmpty.notify_one();
+    return true;
+}
+
+void HttpServer::stopWorkers() {
+    decltype(mWorkerQueue) queued;
+
+    mWorkerQueueMutex.lock();
+    mWorkersShutdown = true;
+    queued.swap(mWorkerQueue);
+    mWorkerQueueMutex.unlock();
+
+    mWorkerQueueNotEmpty.notify_all();
+    mWorkerQueueNotFull.notify_all();
+
+    // connections no worker got to are finished here
+    for (auto& processor : queued) {
+        processor->shutdown();
+        untrackProcessor(processor);
+    }
+
+    for (auto& worker : mWorkers)
+        if (worker.joinable())
+            worker.join();
+
+    mWorkers.clear();
+
+    if (!mIdlePollerThread)
+        return;
+
+    uint64_t one = 1;
+    if (::write(mIdlePollWakeFd, &one, sizeof(one)) < 0)
+        perror("eventfd write");
+
+    mIdlePollerThread->join();
+    mIdlePollerThread.reset();
+
+    // nobody is left to serve the connections still waiting for their clients
+    std::unique_lock<std::mutex> lock{mParkedProcessorsMutex};
+    for (auto& [_, processor] : mParkedProcessors) {
+        processor->mParked = false;
+        processor->mIsAlive = false;
+        processor->mClientStream->close();
+        untrackProcessor(processor);
+    }
+
+    mParkedProcessors.clear();
+    lock.unlock();
+
+    ::close(mIdlePoll);
+    ::close(mIdlePollWakeFd);
+    mIdlePoll = mIdlePollWakeFd = -1;
+}
+
+bool HttpServer::parkProcessor(const std::shared_ptr<Processor>& processor) {
+    // shutdown() either sees the connection parked, or the worker sees it shut down
+    std::unique_lock<std::mutex> shutdownLock{processor->mShutdownMutex};
+    if (!processor->isAlive() || !processor->mClientStream->isOpen())
+        return false;
+
+    std::unique_lock<std::mutex> lock{mParkedProcessorsMutex};
+    auto& spot = processor->mParkingSpot;
+
+    if (spot.empty()) {
+        mParkedProcessors.emplace(processor.get(), processor);
+    } else {
+        spot.mapped() = processor;
+        mParkedProcessors.insert(std::move(spot));
+    }
+
+    processor->mParked = true;
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = processor.get();
+
+    if (epoll_ctl(mIdlePoll, EPOLL_CTL_ADD, processor->mPoolSocket, &ev) == 0)
+        return true;
+
+    // the connection stays with its worker from now on
+    perror("epoll_ctl");
+    processor->mParked = false;
+    processor->mPoolSocket = -1;
+    spot = mParkedProcessors.extract(processor.get());
+    spot.mapped() = nullptr;
+    return false;
+}
+
+bool HttpServer::resumeProcessor(Processor* parked) {
+    std::unique_lock<std::mutex> lock{mParkedProcessorsMutex};
+
+    // events may still arrive for connections that went on since
+    auto it = mParkedProcessors.find(parked);
+    if (it == mParkedProcessors.end() || !parked->mParked.exchange(false))
+        return false;
+
+    // the node is kept for the next park, without the reference to its own processor
+    auto spot = mParkedProcessors.extract(it);
+    auto processor = std::move(spot.mapped());
+    processor->mParkingSpot = std::move(spot);
+
+    // removed before the socket can be closed, its number may be reused right after
+    epoll_ctl(mIdlePoll, EPOLL_CTL_DEL, processor->mPoolSocket, nullptr);
+    lock.unlock();
+
+    if (!enqueueProcessor(processor, true)) {
+        processor->mIsAlive = false;
+        processor->mClientStream->close();
+        untrackProcessor(processor);
+    }
+
+    return true;
+}
+
+void HttpServer::idlePollerThreadProc() {
+    struct epoll_event events[64];
+
+    while (true) {
+        int n = epoll_wait(mIdlePoll, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("epoll_wait");
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            // only the wake-up eventfd has no connection
+            if (!events[i].data.ptr)
+                return;
+
+            resumeProcessor(static_cast<Processor*>(events[i].data.ptr));
+        }
+    }
+}
+
+void HttpServer::timerThreadProc() {
+    HttpTimerWheel timers{sTimerResolution};
+
+    // connections are only looked at when their deadline passes. Clients showing signs of life
+    // in the meantime move the deadline, then the timer is simply armed again.
+    auto expired = [&](HttpTimerWheel::Timer& t) {
+        auto& processor = static_cast<Processor&>(t);
+        if (!processor.isAlive())
+            return;
+
+        auto deadline = processor.deadline();
+        if (deadline <= HttpTimerWheel::Clock::now())
+            processor.shutdown();
+        else
+            timers.arm(processor, deadline);
+    };
+
+    while (!mTimerThreadShutdown) {
+        std::this_thread::sleep_for(sTimerResolution);
+
+        mConnectionEvents.drain([&](ConnectionEvent&& e) {
+            Processor& processor = *e.processor;
+
+            if (e.finished) {
+                if (!processor.mRegistered)
+                    return;
+
+                timers.cancel(processor);
+                processor.mRegistered = false;
+
+                std::unique_lock<std::mutex> lock{mRequestProcessorListMutex};
+                mRequestProcessors.erase(processor.mRegistration);
+            } else if (mSocket == -1) {
+                processor.shutdown();
+            } else {
+                std::unique_lock<std::mutex> lock{mRequestProcessorListMutex};
+                processor.mRegistration = mRequestProcessors.insert(mRequestProcessors.end(), e.processor);
+                processor.mRegistered = true;
+                lock.unlock();
+
+                timers.arm(processor, processor.deadline());
+            }
+        });
+
+        timers.advance(HttpTimerWheel::Clock::now(), expired);
+    }
+
+    // nothing may be left armed when the connections go
+    std::unique_lock<std::mutex> lock{mRequestProcessorListMutex};
+    for (auto& processor : mRequestProcessors) {
+        timers.cancel(*processor);
+        processor->mRegistered = false;
+    }
+
+    mRequestProcessors.clear();
+}
+#endif
+
+#ifdef TINYHTTP_EPOLL
+// "0-3,8-11" style lists of sysfs
+static std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> result;
+    const char* p = list.data();
+    const char* end = p + list.size();
+
+    while (p < end) {
+        int first, last;
+        auto r = std::from_chars(p, end, first);
+        if (r.ec != std::errc{})
+            break;
+
+        last = first;
+        p = r.ptr;
+
+        if (p < end && *p == '-') {
+            r = std::from_chars(p + 1, end, last);
+            if (r.ec != std::errc{})
+                break;
+            p = r.ptr;
+        }
+
+        for (int i = first; i <= last; i++)
+            result.push_back(i);
+
+        if (p < end && *p == ',')
+            p++;
+        else
+            break;
+    }
+
+    return result;
+}
+
+static std::string readLine(const std::string& path) {
+    std::ifstream file{path};
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+// CPUs the event loops are pinned to in turn, empty if they shouldn't be pinned
+static std::vector<int> loopCpus(HttpCpuAffinity affinity) {
+    std::vector<int> cpus;
+
+    if (affinity == HttpCpuAffinity::None || sched_getaffinity(0, sizeof(sProcessCpus), &sProcessCpus) < 0)
+        return cpus;
+
+    if (affinity == HttpCpuAffinity::Numa) {
+        std::vector<std::vector<int>> nodes;
+
+        for (int node : parseCpuList(readLine("/sys/devices/system/node/online"))) {
+            std::vector<int> nodeCpus;
+            for (int cpu : parseCpuList(readLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist")))
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &sProcessCpus))
+                    nodeCpus.push_back(cpu);
+
+            if (!nodeCpus.empty())
+                nodes.push_back(std::move(nodeCpus));
+        }
+
+        // consecutive loops land on different nodes, so they are spread evenly between them
+        for (size_t i = 0, added = 1; added > 0; i++) {
+            added = 0;
+            for (auto& nodeCpus : nodes) {
+                if (i < nodeCpus.size()) {
+                    cpus.push_back(nodeCpus[i]);
+                    added++;
+                }
+            }
+        }
+    }
+
+    // no NUMA information, or it wasn't asked for
+    if (cpus.empty()) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &sProcessCpus))
+                cpus.push_back(cpu);
+    }
+
+    return cpus;
+}
+
+HttpServer::EventLoop::EventLoop(HttpServer& owner, int listener, int cpu)
+    : mOwner{owner}, mListener{listener}, mCpu{cpu}, mTimers{sTimerResolution} {
+    mEpoll = epoll_create1(EPOLL_CLOEXEC);
+    mWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (mEpoll < 0 || mWakeFd < 0)
+        throw std::runtime_error("Could not create event loop");
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = mWakeFd;
+
+    if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, mWakeFd, &ev) < 0)
+        throw std::runtime_error("Could not register event loop wakeup");
+
+    if (mListener >= 0) {
+        ev.data.fd = mListener;
+        if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, mListener, &ev) < 0)
+            throw std::runtime_error("Could not register event loop listener");
+    }
+
+    mThread.reset(new std::thread{[this]() { this->run(); }});
+}
+
+HttpServer::EventLoop::~EventLoop() {
+    stop();
+    join();
+
+    for (auto& c : mConnections) {
+        ::close(c.first);
+        TINYHTTP_METRIC(connectionClosed());
+    }
+
+    for (auto& incoming : mIncoming) {
+        ::close(incoming.socket);
+        TINYHTTP_METRIC(connectionClosed());
+    }
+
+    ::close(mWakeFd);
+    ::close(mEpoll);
+}
+
+void HttpServer::EventLoop::adopt(int socket, HttpConnectionLimits::Slot slot) {
+    mIncomingMutex.lock();
+    mIncoming.push_back({socket, std::move(slot)});
+    mIncomingMutex.unlock();
+
+    uint64_t one = 1;
+    if (::write(mWakeFd, &one, sizeof(one)) < 0)
+        perror("eventfd write");
+}
+
+void HttpServer::EventLoop::stop() {
+    mShutdown = true;
+
+    uint64_t one = 1;
+    if (::write(mWakeFd, &one, sizeof(one)) < 0)
+        perror("eventfd write");
+}
+
+void HttpServer::EventLoop::join() {
+    if (!mThread || !mThread->joinable())
+        return;
+
+    // shutdown() may be called by a handler running on this very loop
+    if (mThread->get_id() == std::this_thread::get_id())
+        mThread->detach();
+    else
+        mThread->join();
+}
+
+void HttpServer::EventLoop::run() {
+    struct epoll_event events[64];
+
+    if (mCpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(mCpu, &cpus);
+
+        // before the loop touches its memory, so it's allocated on the CPU's NUMA node
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            TINYHTTP_LOG_ERROR("Could not pin event loop to CPU %d", mCpu);
+    }
+
+    while (!mShutdown) {
+        int timeout = mTimers.nextTimeout(std::chrono::steady_clock::now()).count();
+        int n = epoll_wait(mEpoll, events, 64, timeout);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n && !mShutdown; i++) {
+            int socket = events[i].data.fd;
+
+            if (socket == mWakeFd) {
+                uint64_t value;
+                while (::read(mWakeFd, &value, sizeof(value)) > 0);
+                adoptIncoming();
+                continue;
+            }
+
+            if (socket == mListener) {
+                acceptIncoming();
+                continue;
+            }
+
+            // the connection could have been closed by an earlier event of this batch
+            auto it = mConnections.find(socket);
+            if (it == mConnections.end())
+                continue;
+
+            Connection& c = *it->second;
 
-        if (asciiOnly && !isascii(ch))
-            throw std::runtime_error("Only ASCII characters were allowed");
+            if (events[i].events & EPOLLERR) {
+                closeConnection(socket);
+                continue;
+            }
+
+            if (!c.output.empty()) {
+                if ((events[i].events & (EPOLLOUT | EPOLLHUP)) && flush(c) && processInput(c) && c.peerClosed && c.output.empty())
+                    closeConnection(socket);
+            } else if (events[i].events & (EPOLLIN | EPOLLHUP)) {
+                onReadable(c);
+            }
+        }
 
-        res.push_back(ch);
+        auto now = std::chrono::steady_clock::now();
+        mTimers.advance(now, [this, now](HttpTimerWheel::Timer& t) {
+            onTimer(static_cast<Connection&>(t), now);
+        });
     }
 
-    return res;
+    // nobody else accepts from it, the kernel resets what's still queued on it
+    if (mListener >= 0) {
+        ::close(mListener);
+        mListener = -1;
+    }
 }
 
-void TCPClientStream::close() {
-    if (mSocket < 0) return;
-    ::shutdown(mSocket, SHUT_RDWR);
-    ::close(mSocket);
-    mSocket = -1;
-}
+void HttpServer::EventLoop::adoptIncoming() {
+    std::vector<Incoming> incoming;
 
-bool HttpRequest::parse(std::shared_ptr<IClientStream> stream) {
-    std::istringstream iss(stream->receiveLine());
-    std::vector<std::string> results(std::istream_iterator<std::string>{iss}, std::istream_iterator<std::string>());
+    mIncomingMutex.lock();
+    incoming.swap(mIncoming);
+    mIncomingMutex.unlock();
 
-    if (results.size() < 2)
-        return false;
+    for (auto& in : incoming)
+        add(in.socket, std::move(in.slot));
+}
 
-    std::string methodString = results[0];
-         if (methodString == "GET"    ) { mMethod = HttpRequestMethod::GET;     }
-    else if (methodString == "POST"   ) { mMethod = HttpRequestMethod::POST;    }
-    else if (methodString == "PUT"    ) { mMethod = HttpRequestMethod::PUT;     }
-    else if (methodString == "DELETE" ) { mMethod = HttpRequestMethod::DELETE;  }
-    else if (methodString == "OPTIONS") { mMethod = HttpRequestMethod::OPTIONS; }
-    else return false;
+void HttpServer::EventLoop::acceptIncoming() {
+    // a batch at a time, so a burst of clients doesn't hold up the open connections
+    for (int i = 0; i < 64 && !mShutdown; i++) {
+        HttpConnectionLimits::Slot slot;
+        int client = mOwner.acceptClient(mListener, SOCK_NONBLOCK | SOCK_CLOEXEC, slot);
 
-    path = results[1];
+        // nothing left, or the client was shed; the listener stays readable while there's more
+        if (client < 0)
+            break;
 
-    size_t question = path.find("?");
-    if (question != std::string::npos) {
-        query = path.substr(question);
-        path = path.substr(0, question);
+        add(client, std::move(slot));
     }
+}
 
-    if (query.empty())
-        std::cout << methodString << " " << path << std::endl;
-    else
-        std::cout << methodString << " " << path << " (Query: " << query << ")" << std::endl;
+// `socket` has to be accepted with SOCK_NONBLOCK
+void HttpServer::EventLoop::add(int socket, HttpConnectionLimits::Slot slot) {
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = socket;
 
-    while (true) {
-        std::string line = stream->receiveLine();
+    if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, socket, &ev) < 0) {
+        perror("epoll_ctl");
+        ::close(socket);
+        TINYHTTP_METRIC(connectionClosed());
+        return;
+    }
 
-        if (line.empty()) break;
+    auto c = std::make_unique<Connection>();
+    c->socket = socket;
+    c->slot = std::move(slot);
 
-        size_t sep = line.find(": ");
-        if (sep == std::string::npos || sep == 0)
-            return false;
+    if constexpr (TINYHTTP_LOG_LEVEL >= 2)
+        formatPeerAddress(socket, c->peer, sizeof(c->peer));
 
-        std::string key = line.substr(0, sep), val = line.substr(sep+2);
-        (*this)[key] = val;
-        //std::cout << "HEADER: <" << key << "> set to <" << val << ">" << std::endl;
-    }
+    // the first request head has to arrive in time
+    c->lastActive = std::chrono::steady_clock::now();
+    c->headDeadline = timeoutAfter(c->lastActive, TINYHTTP_HEADER_TIMEOUT);
+    mTimers.arm(*c, std::min(c->headDeadline, timeoutAfter(c->lastActive, mOwner.mIdleTimeout)));
 
-    std::string contentLength = (*this)["Content-Length"];
-    ssize_t cl = std::atoll(contentLength.c_str());
+    mConnections[socket] = std::move(c);
+}
 
-    if (cl > MAX_HTTP_CONTENT_SIZE)
-        throw std::runtime_error("request too large");
+void HttpServer::EventLoop::onReadable(Connection& c) {
+    // a single request can't take more than this, stop reading until it's processed (with
+    // this much buffered, the parser has either finished the head or rejected it)
+    const size_t maxBuffered = HttpRequestParser::sMaxHeadLength + std::max<size_t>(MAX_HTTP_CONTENT_SIZE, MAX_HTTP_LINE_LENGTH + 1);
 
-    if (cl > 0) {
-        char* tmp = new char[cl];
-        bzero(tmp, cl);
-        stream->receive(tmp, cl);
+    while (c.input.size() < maxBuffered) {
+        size_t available;
+        char* target = c.input.prepare(TINYHTTP_READ_BUFFER_SIZE / 4, available);
+        ssize_t len = recv(c.socket, target, available, 0);
 
-        mContent = std::string(tmp, cl);
-        delete[] tmp;
+        if (len > 0) {
+            TINYHTTP_METRIC(bytesIn(len));
+            c.input.commit(len);
 
-        #ifdef TINYHTTP_JSON
-        if (    (*this)["Content-Type"] == "application/json"
-            ||  (*this)["Content-Type"].rfind("application/json;",0) == 0 // some clients gives us extra data like charset
-        ) {
-            std::string error;
-            mContentJson = miniJson::Json::parse(mContent, error);
-            if (!error.empty())
-                std::cerr << "Content type was JSON but we couldn't parse it! " << error << std::endl;
+            if (static_cast<size_t>(len) < available)
+                break;
+        } else if (len == 0) {
+            c.peerClosed = true;
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            closeConnection(c.socket);
+            return;
         }
-        #endif
     }
 
-    return true;
+    c.lastActive = std::chrono::steady_clock::now();
+
+    // bytes of a new head, it has to be complete in time no matter how they trickle in
+    if (c.state == Connection::State::Head && !c.input.empty() && c.headDeadline == std::chrono::steady_clock::time_point::max())
+        c.headDeadline = timeoutAfter(c.lastActive, TINYHTTP_HEADER_TIMEOUT);
+
+    // answer whatever the client managed to send before closing its side
+    if (processInput(c) && c.peerClosed && c.output.empty())
+        closeConnection(c.socket);
 }
 
-/*static*/ bool HttpHandlerBuilder::isSafeFilename(const std::string& name, bool allowSlash) {
-    static const char allowedChars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.-+@";
-    for (auto x : name) {
-        if (x == '/' && !allowSlash)
-            return false;
+bool HttpServer::EventLoop::processInput(Connection& c) {
+    // every complete request in the buffer is answered in order, their responses are
+    // queued and written together at the end
+    while (!c.closeAfterWrite) {
+        if (c.state == Connection::State::Content) {
+            if (c.input.size() < c.contentLength)
+                break;
 
-        bool ok = false;
-        for (size_t i = 0; allowedChars[i] && !ok; i++)
-            ok = allowedChars[i] == x;
+            c.request->acceptContent(c.input.data(), c.contentLength);
+            c.input.consume(c.contentLength);
 
-        if (!ok) return false;
-    }
+            if (!dispatch(c))
+                return false;
 
-    return true;
-}
+            continue;
+        }
 
-/*static*/ std::string HttpHandlerBuilder::getMimeType(std::string name) {
-    static std::map<std::string, std::string> mMimeDatabase;
+        auto status = c.parser.parse(c.input.data(), c.input.size());
+        if (status == HttpRequestParser::Status::Incomplete)
+            break;
 
-    if (mMimeDatabase.empty()) {
-        mMimeDatabase.insert({"js",   "application/javascript"});
-        mMimeDatabase.insert({"pdf",  "application/pdf"});
-        mMimeDatabase.insert({"gz",   "application/gzip"});
-        mMimeDatabase.insert({"xml",  "application/xml"});
-        mMimeDatabase.insert({"html", "text/html"});
-        mMimeDatabase.insert({"htm",  "text/html"});
-        mMimeDatabase.insert({"css",  "text/css"});
-        mMimeDatabase.insert({"txt",  "text/plain"});
-        mMimeDatabase.insert({"png",  "image/png"});
-        mMimeDatabase.insert({"jpg",  "image/jpeg"});
-        mMimeDatabase.insert({"jpeg", "image/jpeg"});
-        mMimeDatabase.insert({"json", "application/json"});
-    }
+        c.headDeadline = std::chrono::steady_clock::time_point::max();
 
-    size_t pos = name.rfind(".");
-    if (pos == std::string::npos)
-        return "application/octet-stream";
+        bool ok = status == HttpRequestParser::Status::Complete;
+        bool streamed = false, tooLarge = false;
 
-    auto f = mMimeDatabase.find(name.substr(pos+1));
-    if (f == mMimeDatabase.end())
-        return "application/octet-stream";
+        try {
+            if (ok) {
+                if (!c.request)
+                    c.request = std::make_unique<HttpRequest>();
 
-    return f->second;
-}
+                ok = c.request->parse(c.parser, c.input.data());
+            }
 
-HttpServer::Processor::Processor(std::shared_ptr<IClientStream> stream, HttpServer& owner)
-    : mClientStream{std::move(stream)}, mOwner{owner}, mLastActive{std::chrono::system_clock::now()},
-      mIsAlive{true}, mHasHandover{false} { }
+            if (ok) {
+                c.input.consume(c.parser.headLength());
 
-/* static */ void HttpServer::Processor::clientThreadProc(std::shared_ptr<Processor> self) {
-    ICanRequestProtocolHandover* handover = nullptr;
-    std::unique_ptr<HttpRequest> handoverRequest;
+                // streamed and chunked bodies are read by a blocking thread
+                streamed = c.request->hasBody() &&
+                    (c.request->isChunked() || mOwner.streamingBodyLimit(c.request->getPath(), *c.request) > 0);
 
-    try {
-        while (self->mClientStream->isOpen() && self->isAlive()) {
-            HttpRequest req;
+                if (!streamed) {
+                    // answered like the thread path does, which reads the body with this limit
+                    std::string_view length = c.request->header(HttpHeader::ContentLength);
+                    unsigned long long declared = 0;
+                    std::from_chars(length.data(), length.data() + length.size(), declared);
 
-            try {
-                if (!req.parse(self->mClientStream)) {
-                    self->mClientStream->send(self->mOwner.mDefault400Message);
-                    self->mClientStream->close();
-                    continue;
+                    if (declared > MAX_HTTP_CONTENT_SIZE) {
+                        tooLarge = true;
+                    } else {
+                        c.contentLength = c.request->getContentLength();
+                        c.state = Connection::State::Content;
+                    }
                 }
-            } catch (...) {
-                self->mClientStream->send(self->mOwner.mDefault400Message);
-                self->mClientStream->close();
-                continue;
             }
+        } catch (...) {
+            ok = false;
+        }
 
-            auto res = self->mOwner.processRequest(req.getPath(), req);
-            if (res) {
-                #ifndef TINYHTTP_ALLOW_KEEPALIVE
-                (*res)["Connection"] = "close";
-                #endif
+        c.parser.reset();
+
+        if (!ok) {
+            TINYHTTP_METRIC(parseError());
+            c.input.consume(c.input.size());
+            c.output.push(mOwner.mDefault400Message.data(), mOwner.mDefault400Message.size());
+            c.closeAfterWrite = true;
+            break;
+        }
 
-                auto builtMessage = res->buildMessage();
-                self->mClientStream->send(builtMessage);
+        if (tooLarge) {
+            c.input.consume(c.input.size());
+            c.output.push(mOwner.mDefault413Message.data(), mOwner.mDefault413Message.size());
+            c.closeAfterWrite = true;
+            break;
+        }
 
-                if (res->acceptProtocolHandover(&handover)) {
-                    handoverRequest = std::make_unique<HttpRequest>(req);
-                    break;
-                }
+        if (streamed) {
+            // the connection stays with that thread from now on
+            auto request = std::move(c.request);
+            size_t served = c.served;
+            auto processor = detach(c); // destroys c
 
-                goto keep_alive_check;
+            if (processor) {
+                processor->setPendingRequest(std::move(request), served);
+                processor->startThread();
             }
 
-            self->mClientStream->send(self->mOwner.mDefault404Message);
+            return false;
+        }
 
-            keep_alive_check:
-            self->mLastActive = std::chrono::system_clock::now();
-            
-            #ifdef TINYHTTP_ALLOW_KEEPALIVE
-            if (req["Connection"] != "keep-alive")
-                break;
-            #else
-            break;
-            #endif
+        if (c.contentLength > c.input.size() && c.request->expectsContinue()) {
+            static const char continueMessage[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            c.output.push(continueMessage, sizeof(continueMessage) - 1);
         }
+    }
+
+    if (c.output.empty() && !c.closeAfterWrite)
+        return true;
 
-        if (handover) {
-            puts("Doing handover");
-            self->mHasHandover = true;
-            handover->acceptHandover(self->mOwner.mSocket, *self->mClientStream.get(), std::move(handoverRequest));
-            puts("Handover proc exited");
+    return flush(c);
+}
+
+bool HttpServer::EventLoop::dispatch(Connection& c) {
+    HttpRequest& req = *c.request;
+    c.state = Connection::State::Head;
+
+    HttpResponse& res = c.response;
+    bool keep;
+
+    if (mOwner.processRequest(req.getPath(), req, res)) {
+        keep = mOwner.keepConnection(req, &res, ++c.served);
+        res.moveInto(c.output);
+        logAccess(req, c.peer, res.statusCode(), res.contentLength());
+
+        ICanRequestProtocolHandover* handover = nullptr;
+        if (res.acceptProtocolHandover(&handover)) {
+            // protocol handlers expect a blocking stream, so the socket leaves the loop for its own thread
+            // (bytes the client sent after the request belong to the new protocol)
+            auto request = std::move(c.request);
+
+            auto processor = detach(c);
+            if (processor)
+                processor->startHandoverThread(handover, std::move(request));
+
+            return false;
         }
+    } else {
+        keep = mOwner.keepConnection(req, nullptr, ++c.served);
+        const MessageBuilder& notFound = mOwner.notFoundMessage(req, keep);
+        c.output.push(notFound.data(), notFound.size());
+        logAccess(req, c.peer, 404, sNotFoundBody.size());
+    }
+
+    if (!keep)
+        c.closeAfterWrite = true;
+
+    return true;
+}
+
+std::shared_ptr<HttpServer::Processor> HttpServer::EventLoop::detach(Connection& c) {
+    int socket = c.socket;
+    OutputQueue output = std::move(c.output);
+
+    // data the client sent after the request head goes with the connection
+    auto tcpStream = std::make_shared<TCPClientStream>(socket, std::move(c.input));
+    tcpStream->holdSlot(std::move(c.slot));
+    std::shared_ptr<IClientStream> stream = std::move(tcpStream);
+
+    epoll_ctl(mEpoll, EPOLL_CTL_DEL, socket, nullptr);
+    mConnections.erase(socket);
+
+    int flags = fcntl(socket, F_GETFL, 0);
+    if (flags >= 0)
+        fcntl(socket, F_SETFL, flags & ~O_NONBLOCK);
+
+    // responses queued before have to arrive first
+    try {
+        output.flush(*stream);
     } catch (std::exception& e) {
-        // Don't print the exception when we are getting shut down, it's expected to be raised
-        if (self->isAlive()) {
-            std::cerr << "Exception in HTTP client handler (" << e.what() << ")\n";
-        }
+        TINYHTTP_LOG_ERROR("Exception in HTTP client handler (%s)", e.what());
+        return nullptr; // the stream closes the socket
     }
 
-    self->mClientStream->close();
-    self->mIsAlive = false;
+    auto processor = std::make_shared<Processor>(stream, mOwner);
+    mOwner.trackProcessor(processor);
+    return processor;
 }
 
-bool HttpServer::Processor::isTimedOut() const noexcept {
-    if constexpr (TINYHTTP_CLIENT_TIMEOUT <= 0) {
+bool HttpServer::EventLoop::flush(Connection& c) {
+    if (!c.output.flush(c.socket)) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            watch(c, true);
+            return true;
+        }
+
+        closeConnection(c.socket);
         return false;
     }
 
-    if (mHasHandover) {
+    c.lastActive = std::chrono::steady_clock::now();
+
+    if (c.closeAfterWrite) {
+        closeConnection(c.socket);
         return false;
     }
 
-    auto duration = std::chrono::system_clock::now() - mLastActive;
-    return duration > std::chrono::seconds(TINYHTTP_CLIENT_TIMEOUT);
+    watch(c, false);
+    return true;
 }
 
-void HttpServer::Processor::shutdown() {
-    #ifdef TINYHTTP_THREADING
-    std::unique_lock{mShutdownMutex};
-    #endif
+void HttpServer::EventLoop::watch(Connection& c, bool output) {
+    if (c.watchingOutput == output)
+        return;
 
-    mIsAlive = false;
-    
-    if (mClientStream && mClientStream->isOpen())
-        mClientStream->close();
+    struct epoll_event ev = {};
+    ev.events = output ? EPOLLOUT : EPOLLIN;
+    ev.data.fd = c.socket;
 
-    #ifdef TINYHTTP_THREADING
-    if (mWorkThread && mWorkThread->joinable())
-        mWorkThread->detach();
-    #endif
-}
+    if (epoll_ctl(mEpoll, EPOLL_CTL_MOD, c.socket, &ev) < 0)
+        perror("epoll_ctl");
 
-#ifdef TINYHTTP_THREADING
-void HttpServer::Processor::startThread() {
-    auto self_ptr = shared_from_this();
-    mWorkThread.reset(new std::thread{[self_ptr]() {
-        clientThreadProc(self_ptr);
-    }});
+    c.watchingOutput = output;
 }
 
-void HttpServer::cleanupThreadProc() {
-    while (!mCleanupThreadShutdown) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-        if (mSocket == -1)
-            continue;
-        
-        mRequestProcessorListMutex.lock();
-        for (auto it = mRequestProcessors.begin(); it != mRequestProcessors.end(); ++it) {
-            auto& processor = *it;
+void HttpServer::EventLoop::closeConnection(int socket) {
+    epoll_ctl(mEpoll, EPOLL_CTL_DEL, socket, nullptr);
+    ::shutdown(socket, SHUT_RDWR);
+    ::close(socket);
+    mConnections.erase(socket);
+    TINYHTTP_METRIC(connectionClosed());
+}
 
-            if (processor->isTimedOut()) {
-                processor->shutdown();
-            }
+void HttpServer::EventLoop::onTimer(Connection& c, std::chrono::steady_clock::time_point now) {
+    auto deadline = std::min(c.headDeadline, timeoutAfter(c.lastActive, mOwner.mIdleTimeout));
 
-            if (!processor->isAlive()) {
-                mRequestProcessors.erase(it);
-                it = mRequestProcessors.begin();
-            }
-        }
-        mRequestProcessorListMutex.unlock();
-    }
+    if (deadline <= now)
+        closeConnection(c.socket);
+    else if (deadline != std::chrono::steady_clock::time_point::max())
+        mTimers.arm(c, deadline);
 }
 #endif
 
 HttpServer::HttpServer() {
-    mDefault404Message = HttpResponse{404, "text/plain", "404 not found"}.buildMessage();
-    mDefault400Message = HttpResponse{400, "text/plain", "400 bad request"}.buildMessage();
+    // built once and sent as they are, so these can't carry a Date
+    auto message = [](unsigned statusCode, const char* text, const char* connection = "") {
+        HttpResponse res{statusCode, "text/plain", text};
+        res[HttpHeader::Date] = "";
+        res[HttpHeader::Connection] = connection;
+        return res.buildMessage();
+    };
+
+    mDefault404Message = message(404, sNotFoundBody.data());
+    mDefault404KeepAliveMessage = message(404, sNotFoundBody.data(), "keep-alive");
+    mDefault404CloseMessage = message(404, sNotFoundBody.data(), "close");
+    mDefault400Message = message(400, "400 bad request");
+    mDefault413Message = message(413, "413 payload too large");
+    mDefault503Message = message(503, "503 service unavailable");
 
     #ifdef TINYHTTP_THREADING
-    mCleanupThread.reset(new std::thread{[this]() { this->cleanupThreadProc(); }});
+    mTimerThread.reset(new std::thread{[this]() { this->timerThreadProc(); }});
     #endif
 }
 
-void HttpServer::startListening(uint16_t port) {
-    if (mSocket != -1)
-        throw std::runtime_error("Server is already running");
-
-    mSocket = socket(AF_INET, SOCK_STREAM, 0);
+int HttpServer::openListener(uint16_t port, bool reusePort) {
+    // sharded listeners are polled by their event loop, the others block in accept
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (reusePort ? SOCK_NONBLOCK : 0), 0);
 
-    if (mSocket == -1)
+    if (sock == -1)
         throw std::runtime_error("Could not create socket");
 
     int opt = 1;
-    if (setsockopt(mSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
         perror("setsockopt");
+        ::close(sock);
         throw std::runtime_error("Could not set SO_REUSEADDR option");
     }
 
+    if (reusePort && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt");
+        ::close(sock);
+        throw std::runtime_error("Could not set SO_REUSEPORT option");
+    }
+
     struct sockaddr_in remote = {};
 
     remote.sin_family = AF_INET;
@@ -344,7 +4050,7 @@ void HttpServer::startListening(uint16_t port) {
     int iRetval;
 
     while (true) {
-        iRetval = bind(mSocket, reinterpret_cast<struct sockaddr*>(&remote), sizeof(remote));
+        iRetval = bind(sock, reinterpret_cast<struct sockaddr*>(&remote), sizeof(remote));
 
         if (iRetval < 0) {
             perror("Failed to bind socket, retrying in 5 seconds...");
@@ -356,31 +4062,217 @@ void HttpServer::startListening(uint16_t port) {
         } else break;
     }
 
-    iRetval = ::listen(mSocket, 3);
-    if (iRetval < 0)
+    iRetval = ::listen(sock, mListenBacklog);
+    if (iRetval < 0) {
+        ::close(sock);
         throw std::runtime_error("listen() failed");
+    }
+
+    return sock;
+}
+
+// the soft limit is often 1024, far below the connections a server should take
+static void raiseFileLimit() {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur >= limit.rlim_max)
+        return;
+
+    rlim_t previous = limit.rlim_cur;
+    limit.rlim_cur = limit.rlim_max;
+
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0)
+        perror("setrlimit");
+    else
+        TINYHTTP_LOG_DEBUG("Raised the open file limit from %llu to %llu",
+            static_cast<unsigned long long>(previous), static_cast<unsigned long long>(limit.rlim_cur));
+}
+
+void HttpServer::startListening(uint16_t port) {
+    if (mSocket != -1)
+        throw std::runtime_error("Server is already running");
+
+    if constexpr (TINYHTTP_RAISE_FILE_LIMIT)
+        raiseFileLimit();
+
+    #ifdef TINYHTTP_EPOLL
+    if (mShardedListeners) {
+        runEventLoops(port);
+        return;
+    }
+    #endif
+
+    mSocket = openListener(port, false);
+
+    #ifdef TINYHTTP_THREADING
+    if (mWorkerCount > 0 && mWorkers.empty()) {
+        mWorkersShutdown = false;
+        for (size_t i = 0; i < mWorkerCount; i++)
+            mWorkers.emplace_back([this]() { this->workerThreadProc(); });
+
+        // without the idle poller, workers wait for the next request themselves
+        mIdlePoll = epoll_create1(EPOLL_CLOEXEC);
+        mIdlePollWakeFd = eventfd(0, EFD_CLOEXEC);
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+
+        if (mIdlePoll < 0 || mIdlePollWakeFd < 0 || epoll_ctl(mIdlePoll, EPOLL_CTL_ADD, mIdlePollWakeFd, &ev)) {
+            perror("idle poller");
+
+            if (mIdlePoll >= 0)
+                ::close(mIdlePoll);
+            if (mIdlePollWakeFd >= 0)
+                ::close(mIdlePollWakeFd);
+
+            mIdlePoll = mIdlePollWakeFd = -1;
+        } else {
+            mIdlePollerThread.reset(new std::thread{[this]() { this->idlePollerThreadProc(); }});
+        }
+    }
+    #endif
 
     printf("Waiting for incoming connections...\n");
+
+    #ifdef TINYHTTP_EPOLL
+    if (mEventLoopCount > 0) {
+        auto cpus = loopCpus(mCpuAffinity);
+        sLoopsPinned = !cpus.empty();
+
+        mEventLoops.clear();
+        for (unsigned i = 0; i < mEventLoopCount; i++)
+            mEventLoops.push_back(std::make_unique<EventLoop>(*this, -1, cpus.empty() ? -1 : cpus[i % cpus.size()]));
+
+        for (size_t next = 0; mSocket != -1;) {
+            HttpConnectionLimits::Slot slot;
+            int client = acceptClient(mSocket, SOCK_NONBLOCK | SOCK_CLOEXEC, slot);
+
+            if (client >= 0)
+                mEventLoops[next++ % mEventLoops.size()]->adopt(client, std::move(slot));
+        }
+
+        HttpLogger::instance().flush();
+        puts("Listen loop exited");
+        return;
+    }
+    #endif
+
     while (mSocket != -1) {
-        auto processor = std::make_shared<Processor>(
-            std::make_shared<TCPClientStream>(TCPClientStream::acceptFrom(mSocket)),
-            *this
-        );
+        HttpConnectionLimits::Slot slot;
+        int client = acceptClient(mSocket, SOCK_CLOEXEC, slot);
+        if (client < 0)
+            continue;
+
+        auto tcpStream = std::make_shared<TCPClientStream>(client);
+        tcpStream->holdSlot(std::move(slot));
+
+        std::shared_ptr<IClientStream> stream = std::move(tcpStream);
+        auto processor = std::make_shared<Processor>(stream, *this);
 
         #ifdef TINYHTTP_THREADING
-        processor->startThread();
+        trackProcessor(processor);
 
-        mRequestProcessorListMutex.lock();
-        mRequestProcessors.push_back(std::move(processor));
-        mRequestProcessorListMutex.unlock();
+        if (mWorkerCount == 0) {
+            processor->startThread();
+            continue;
+        }
+
+        if (mIdlePoll >= 0)
+            processor->mPoolSocket = client;
+
+        if (!enqueueProcessor(processor)) {
+            // the stream is still ours, shed the connection with the prebuilt reply
+            try {
+                stream->send(mDefault503Message);
+            } catch (...) {}
+
+            TINYHTTP_METRIC(shed(HttpShedReason::QueueFull));
+            processor->shutdown();
+            untrackProcessor(processor);
+        }
         #else
         mCurrentProcessor = processor;
         Processor::clientThreadProc(processor);
         #endif
     }
 
+    HttpLogger::instance().flush();
+    puts("Listen loop exited");
+}
+
+#ifdef TINYHTTP_EPOLL
+void HttpServer::runEventLoops(uint16_t port) {
+    auto cpus = loopCpus(mCpuAffinity);
+    sLoopsPinned = !cpus.empty();
+
+    unsigned count = mEventLoopCount;
+    if (count == 0) {
+        cpu_set_t usable;
+        count = sched_getaffinity(0, sizeof(usable), &usable) == 0 ? CPU_COUNT(&usable) : std::thread::hardware_concurrency();
+        count = std::max(count, 1u);
+    }
+
+    // every socket has to be listening before the loops start, or the kernel has no group to balance
+    std::vector<int> listeners;
+    try {
+        for (unsigned i = 0; i < count; i++)
+            listeners.push_back(openListener(port, true));
+    } catch (...) {
+        for (int listener : listeners)
+            ::close(listener);
+        throw;
+    }
+
+    // only marks the server as running and wakes the first loop on shutdown, that loop closes it
+    mSocket = listeners[0];
+
+    printf("Waiting for incoming connections...\n");
+
+    mEventLoops.clear();
+    for (unsigned i = 0; i < count; i++)
+        mEventLoops.push_back(std::make_unique<EventLoop>(*this, listeners[i], cpus.empty() ? -1 : cpus[i % cpus.size()]));
+
+    for (auto& loop : mEventLoops)
+        loop->join();
+
+    HttpLogger::instance().flush();
     puts("Listen loop exited");
 }
+#endif
+
+int HttpServer::acceptClient(int listener, int flags, HttpConnectionLimits::Slot& slot) {
+    struct sockaddr_storage addr;
+    socklen_t addrLen = sizeof(addr);
+
+    int client = accept4(listener, reinterpret_cast<struct sockaddr*>(&addr), &addrLen, flags);
+    if (client < 0) {
+        if (mSocket != -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("accept failed");
+        return -1;
+    }
+
+    TINYHTTP_METRIC(connectionOpened());
+
+    HttpShedReason reason;
+    if (!mLimits.acquire(reinterpret_cast<struct sockaddr*>(&addr), slot, reason)) {
+        shedClient(client, reason);
+        return -1;
+    }
+
+    return client;
+}
+
+void HttpServer::shedClient(int socket, HttpShedReason reason) {
+    // a full socket buffer is not waited for, the client is over its limit anyway
+    if (::send(socket, mDefault503Message.data(), mDefault503Message.size(), MSG_NOSIGNAL | MSG_DONTWAIT) < 0 && errno != EAGAIN)
+        TINYHTTP_LOG_DEBUG("Could not send 503 to a shed client (%s)", strerror(errno));
+
+    ::shutdown(socket, SHUT_RDWR);
+    ::close(socket);
+    TINYHTTP_METRIC(connectionClosed());
+    TINYHTTP_METRIC(shed(reason));
+}
 
 void HttpServer::shutdown() {
     int sock = mSocket;
@@ -394,15 +4286,31 @@ void HttpServer::shutdown() {
     puts("Shutting down server");
     ::shutdown(sock, SHUT_RDWR);
 
+    #ifdef TINYHTTP_EPOLL
+    for (auto& loop : mEventLoops)
+        loop->stop();
+    #endif
+
     #ifdef TINYHTTP_THREADING
+    // the timer thread lets go of them once they are finished
     mRequestProcessorListMutex.lock();
-    mRequestProcessors.clear();
+    for (auto& processor : mRequestProcessors)
+        processor->shutdown();
     mRequestProcessorListMutex.unlock();
+
+    // wakes up the accept loop if it's waiting for room in the worker queue
+    mWorkerQueueNotFull.notify_all();
     #else
     if (mCurrentProcessor) {
         mCurrentProcessor->shutdown();
     }
     #endif
 
+    #ifdef TINYHTTP_EPOLL
+    // sharded listeners are closed by their event loops
+    if (mShardedListeners)
+        return;
+    #endif
+
     close(sock);
 }
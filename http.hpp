@@ -13,6 +13,17 @@
 // threading support
 #define TINYHTTP_THREADING
 
+// epoll based event loop mode (linux only, opt-in with HttpServer::setEventLoopCount)
+// (requires TINYHTTP_THREADING)
+#define TINYHTTP_EPOLL
+
+// SIMD accelerated scanning of request heads (x86 only, the instruction set is
+// picked at runtime and everything falls back to scalar code)
+#define TINYHTTP_SIMD
+
+// request counters and latency histograms, see HttpMetrics
+#define TINYHTTP_METRICS
+
 // allow keep-alive connections
 // (you should disable this if you are using a single thread)
 #define TINYHTTP_ALLOW_KEEPALIVE
@@ -25,6 +36,18 @@
 #  define MAX_HTTP_CONTENT_SIZE (50*1024) // 50kiB
 #endif
 
+#ifndef MAX_HTTP_LINE_LENGTH
+#  define MAX_HTTP_LINE_LENGTH (8*1024) // 8kiB, request line or a single header
+#endif
+
+#ifndef MAX_HTTP_RANGES
+#  define MAX_HTTP_RANGES 16 // Range headers with more are ignored
+#endif
+
+#ifndef MAX_PATH_PARAMS
+#  define MAX_PATH_PARAMS 8 // :name segments in a single route
+#endif
+
 #ifndef MAX_ALLOWED_WS_FRAME_LENGTH
 #  define MAX_ALLOWED_WS_FRAME_LENGTH (50*1024) // 50kiB
 #endif
@@ -40,12 +63,38 @@
 #  define TINYHTTP_CLIENT_TIMEOUT (30) // Seconds
 #endif
 
+// Disabled if set to a <= 0 value
+// Time a client has to send a complete request head, counted from the connection
+// or from the first byte of the head on keep-alive connections
+#ifndef TINYHTTP_HEADER_TIMEOUT
+#  define TINYHTTP_HEADER_TIMEOUT (10) // Seconds
+#endif
+
+// Disabled if set to a <= 0 value
+// Timeout for WebSocket connections not receiving any message
+#ifndef TINYHTTP_WS_IDLE_TIMEOUT
+#  define TINYHTTP_WS_IDLE_TIMEOUT (0) // Seconds
+#endif
+
+// Time the server's destructor waits for connection threads to finish once their
+// sockets are closed, a handler that never returns after that is given up on
+#ifndef TINYHTTP_SHUTDOWN_TIMEOUT
+#  define TINYHTTP_SHUTDOWN_TIMEOUT (10) // Seconds
+#endif
+
+// Raise the soft RLIMIT_NOFILE to the hard one when the server starts, every
+// connection takes a file descriptor
+#ifndef TINYHTTP_RAISE_FILE_LIMIT
+#  define TINYHTTP_RAISE_FILE_LIMIT 1
+#endif
+
 #include <cstdint>
 #include <cstring>
 #include <string>
 #include <memory>
 #include <stdexcept>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <regex>
@@ -53,11 +102,23 @@
 #include <iostream>
 #include <fstream>
 #include <list>
+#include <unordered_map>
 #include <chrono>
+#include <string_view>
+#include <optional>
+#include <ctime>
+#include <atomic>
+#include <functional>
 
 #ifdef TINYHTTP_THREADING
 #  include <thread>
 #  include <mutex>
+#  include <condition_variable>
+#  include <deque>
+#endif
+
+#if defined(TINYHTTP_EPOLL) && !defined(TINYHTTP_THREADING)
+#  error "TINYHTTP_EPOLL requires TINYHTTP_THREADING"
 #endif
 
 #ifdef TINYHTTP_JSON
@@ -91,6 +152,88 @@ enum {
 };
 #endif
 
+// Byte scanning primitives used by the parser, backed by AVX2 or SSE4.2 kernels when
+// the CPU supports them
+namespace httpscan {
+    // first occurrence of `ch`, nullptr if there is none
+    const char* find(const char* data, size_t size, char ch) noexcept;
+    // true if every byte is 7-bit ASCII
+    bool isAscii(const char* data, size_t size) noexcept;
+    // true if the data is a non-empty RFC 7230 token (method, header name)
+    bool isToken(const char* data, size_t size) noexcept;
+    // name of the selected implementation: "avx2", "sse4.2" or "scalar"
+    const char* implementation() noexcept;
+}
+
+#ifndef TINYHTTP_CHUNK_SIZE
+#  define TINYHTTP_CHUNK_SIZE (16*1024) // 16kiB, largest chunk asked from a response producer
+#endif
+
+#ifndef TINYHTTP_CONTENT_RETAIN
+#  define TINYHTTP_CONTENT_RETAIN (64*1024) // 64kiB, body memory a connection keeps between requests
+#endif
+
+#ifndef TINYHTTP_LOG_LEVEL
+#  define TINYHTTP_LOG_LEVEL 2 // messages compiled in: 0 none, 1 errors, 2 errors and access log, 3 debug too
+#endif
+
+#ifndef TINYHTTP_LOG_BUFFER_SIZE
+#  define TINYHTTP_LOG_BUFFER_SIZE (64*1024) // 64kiB, ring of lines not written yet (power of 2)
+#endif
+
+#ifndef TINYHTTP_LOG_RINGS
+#  define TINYHTTP_LOG_RINGS 64 // threads logging into a ring of their own, the rest share one
+#endif
+
+#ifndef TINYHTTP_LOG_LINE_LENGTH
+#  define TINYHTTP_LOG_LINE_LENGTH 2048 // longer log lines are cut
+#endif
+
+#ifndef TINYHTTP_METRICS_MAX_ROUTES
+#  define TINYHTTP_METRICS_MAX_ROUTES 32 // routes with series of their own, the rest is counted as "other"
+#endif
+
+#ifndef TINYHTTP_METRICS_SHARDS
+#  define TINYHTTP_METRICS_SHARDS 64 // threads counting into a shard of their own, the rest share one
+#endif
+
+#ifndef TINYHTTP_READ_BUFFER_SIZE
+#  define TINYHTTP_READ_BUFFER_SIZE (16*1024) // 16kiB, initial size of the per connection read buffer
+#endif
+
+// Read-ahead buffer of a connection. It lives as long as the connection, so the
+// memory is reused by every keep-alive request. Data is consumed from the front
+// and only moved back to the start when room is needed at the end, keeping the
+// buffered bytes contiguous for the parser.
+class StreamBuffer {
+    std::unique_ptr<char[]> mData;
+    size_t mCapacity = 0, mBegin = 0, mEnd = 0;
+
+    public:
+        const char* data() const noexcept { return mData.get() + mBegin; }
+        size_t size() const noexcept { return mEnd - mBegin; }
+        bool empty() const noexcept { return mBegin == mEnd; }
+
+        void consume(size_t n) noexcept {
+            mBegin += std::min(n, size());
+            if (mBegin == mEnd)
+                mBegin = mEnd = 0;
+        }
+
+        // copies out and consumes at most `max` bytes
+        size_t read(void* target, size_t max) noexcept {
+            size_t len = std::min(max, size());
+            memcpy(target, data(), len);
+            consume(len);
+            return len;
+        }
+
+        // returns a writable area at the end with room for at least `min` bytes,
+        // bytes written there must be published with commit()
+        char* prepare(size_t min, size_t& available);
+        void commit(size_t n) noexcept { mEnd += n; }
+};
+
 struct IClientStream {
     virtual ~IClientStream() = default;
     virtual bool isOpen() noexcept = 0;
@@ -99,6 +242,30 @@ struct IClientStream {
     virtual std::string receiveLine(bool asciiOnly = true, size_t max = -1) = 0;
     virtual void close() = 0;
 
+    // sends the buffers back to back, `parts` may be modified while doing so
+    virtual void sendv(struct iovec* parts, size_t count) {
+        for (size_t i = 0; i < count; i++)
+            send(parts[i].iov_base, parts[i].iov_len);
+    }
+
+    // sends `length` bytes of a file starting at `offset`
+    virtual void sendFile(int fd, off_t offset, size_t length);
+
+    // Streams with a read-ahead buffer let the request parser work on it in place.
+    // fillReadBuffer() blocks until more data arrives and returns the number of new bytes.
+    virtual StreamBuffer* readBuffer() noexcept { return nullptr; }
+    virtual size_t fillReadBuffer() { return 0; }
+
+    // address of the other end for the access log, "-" if there is none
+    virtual std::string_view peerAddress() { return "-"; }
+
+    // Last sign of life from the client, connections are timed out relative to it.
+    // Protocol handlers taking over the stream call touch() for every message.
+    void touch() noexcept { mLastActive.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed); }
+    std::chrono::steady_clock::time_point lastActive() const noexcept {
+        return std::chrono::steady_clock::time_point{std::chrono::steady_clock::duration{mLastActive.load(std::memory_order_relaxed)}};
+    }
+
     // wrapper for send for any object having a data() -> uint8_t* and a size() -> integer function
     template<
         typename T,
@@ -107,25 +274,114 @@ struct IClientStream {
     >
     void send(const T& data) { send(data.data(), data.size()); }
 
+    // keeps receiving until `size` bytes arrived, false if the stream ended before that
+    bool receiveAll(void* target, size_t size) {
+        uint8_t* ptr = reinterpret_cast<uint8_t*>(target);
+
+        while (size > 0) {
+            size_t len = receive(ptr, size);
+            if (len == 0)
+                return false;
+
+            ptr += len;
+            size -= len;
+        }
+
+        return true;
+    }
+
     bool mErrorFlag = false;
+    std::atomic<std::chrono::steady_clock::rep> mLastActive{std::chrono::steady_clock::now().time_since_epoch().count()};
+};
+
+// why a new connection was answered with a 503 and closed right away
+enum class HttpShedReason {
+    ServerFull, // the server has its maximum number of connections open
+    ClientFull, // the client address has its maximum number of connections open
+    QueueFull   // every pool worker is busy and the queue is full
+};
+
+// Caps on concurrent connections, in total and per client address. Addresses are hashed
+// into a fixed table of counters, so clients sharing a bucket also share their cap.
+// Nothing is counted while both caps are 0.
+class HttpConnectionLimits {
+    public:
+        static constexpr size_t sClientBuckets = 4096;
+
+        // held by a connection for as long as it is open
+        class Slot {
+            friend class HttpConnectionLimits;
+
+            HttpConnectionLimits* mLimits = nullptr;
+            size_t mBucket = sClientBuckets; // none
+
+            public:
+                Slot() = default;
+                Slot(Slot&& other) noexcept : mLimits{other.mLimits}, mBucket{other.mBucket} { other.mLimits = nullptr; }
+                Slot& operator=(Slot&& other) noexcept {
+                    if (this != &other) {
+                        release();
+                        mLimits = other.mLimits;
+                        mBucket = other.mBucket;
+                        other.mLimits = nullptr;
+                    }
+
+                    return *this;
+                }
+
+                ~Slot() { release(); }
+
+                void release() noexcept;
+        };
+
+    private:
+        std::atomic<size_t> mOpen{0};
+        std::atomic<uint32_t> mClients[sClientBuckets]{};
+        size_t mMaxConnections = 0, mMaxPerClient = 0;
+
+    public:
+        // 0 means no limit
+        void set(size_t maxConnections, size_t maxPerClient) noexcept {
+            mMaxConnections = maxConnections;
+            mMaxPerClient = maxPerClient;
+        }
+
+        // fills `slot` if the client at `addr` is within the limits, otherwise sets `reason`
+        bool acquire(const struct sockaddr* addr, Slot& slot, HttpShedReason& reason) noexcept;
+
+        // connections holding a slot
+        size_t open() const noexcept { return mOpen.load(std::memory_order_relaxed); }
 };
 
 class TCPClientStream : public IClientStream {
     int mSocket;
+    StreamBuffer mReadBuffer;
+    char mPeer[INET6_ADDRSTRLEN] = ""; // looked up on first use
+    HttpConnectionLimits::Slot mSlot;
 
     public:
         ~TCPClientStream() { close(); }
-        TCPClientStream(short socket) : mSocket{socket} {}
+        TCPClientStream(int socket) : mSocket{socket} {}
+        // takes over a socket together with the data already read from it
+        TCPClientStream(int socket, StreamBuffer readAhead) : mSocket{socket}, mReadBuffer{std::move(readAhead)} {}
         TCPClientStream(const TCPClientStream&) = delete;
-        TCPClientStream(TCPClientStream&& other) : mSocket{other.mSocket} { other.mSocket = -1; }
+        TCPClientStream(TCPClientStream&& other)
+            : mSocket{other.mSocket}, mReadBuffer{std::move(other.mReadBuffer)}, mSlot{std::move(other.mSlot)} { other.mSocket = -1; }
 
-        static TCPClientStream acceptFrom(short listener);
+        // the slot is given back when the stream is closed
+        void holdSlot(HttpConnectionLimits::Slot slot) noexcept { mSlot = std::move(slot); }
 
         bool isOpen() noexcept override { return mSocket >= 0 && !mErrorFlag; }
         void send(const void* what, size_t size) override;
+        void sendv(struct iovec* parts, size_t count) override;
+        void sendFile(int fd, off_t offset, size_t length) override;
         size_t receive(void* target, size_t max) override;
         std::string receiveLine(bool asciiOnly = true, size_t max = -1) override;
         void close() override;
+
+        StreamBuffer* readBuffer() noexcept override { return &mReadBuffer; }
+        size_t fillReadBuffer() override;
+        std::string_view peerAddress() override;
 };
 
 struct StdinClientStream : IClientStream {
@@ -172,64 +428,425 @@ struct MessageBuilder : public std::vector<uint8_t> {
     }
 };
 
-class HttpMessageCommon {
-    protected:
-        std::map<std::string, std::string> mHeaders;
-        std::string mContent;
+// Open file used as a response body. It's never read into memory, the bytes
+// go from the page cache to the socket with sendfile.
+class HttpFileBody {
+    int mFd;
+    size_t mLength;
+    time_t mModified;
+    std::string mETag;
+
+    HttpFileBody(int fd, size_t length, time_t modified, std::string etag)
+        : mFd{fd}, mLength{length}, mModified{modified}, mETag{std::move(etag)} {}
 
     public:
-        std::string& operator[](std::string i) {
-            std::transform(i.begin(), i.end(), i.begin(), [](unsigned char c){ return std::tolower(c); });
+        ~HttpFileBody() { ::close(mFd); }
+        HttpFileBody(const HttpFileBody&) = delete;
+        HttpFileBody& operator=(const HttpFileBody&) = delete;
+
+        // nullptr if the file can't be opened or isn't a regular file
+        static std::shared_ptr<HttpFileBody> open(const std::string& path);
+
+        int fd() const noexcept { return mFd; }
+        size_t length() const noexcept { return mLength; }
+        time_t modified() const noexcept { return mModified; }
+        // strong validator made of the inode, modification time and size
+        const std::string& etag() const noexcept { return mETag; }
+};
 
-            auto f = mHeaders.find(i);
-            if (f == mHeaders.end()) {
-                if (mHeaders.size() >= MAX_HTTP_HEADERS)
-                    throw std::runtime_error("too many HTTP headers");
+// Generates a response body while it's being sent: writes at most `max` bytes to
+// `buffer` and returns the count, 0 ends the body
+using HttpBodyProducer = std::function<size_t(void* buffer, size_t max)>;
+
+// Response bytes waiting to be written to a connection. Heads are serialized into a
+// buffer that lives as long as the queue, bodies are either moved into the queue or only
+// referenced and kept alive by their owner until they are written, then everything goes
+// out with writev.
+class OutputQueue {
+    struct Segment {
+        const uint8_t* data; // nullptr if the bytes are in mHeadBuffer or the file at `offset`
+        size_t offset, size;
+        int fd; // >= 0 for file segments
+        const HttpBodyProducer* producer; // set for generated bodies
+        std::shared_ptr<const void> owner;
+        bool chunked = true; // the producer's data is framed in chunks, otherwise sent as it is
+    };
+
+    MessageBuilder mHeadBuffer;
+    std::vector<Segment> mSegments;
+    size_t mFirst = 0;
+
+    // bodies and producers handed over by responses, in slots that are reused once the
+    // queue is empty (a slot is only allocated when more are queued than ever before)
+    std::vector<std::unique_ptr<std::string>> mBodies;
+    std::vector<std::unique_ptr<HttpBodyProducer>> mProducers;
+    size_t mBodiesUsed = 0, mProducersUsed = 0;
+
+    // chunk of the producer being sent, only one is buffered at a time
+    MessageBuilder mChunk;
+    size_t mChunkPos = 0;
+    bool mChunkLast = false;
+
+    size_t gather(struct iovec* parts, size_t max) const noexcept;
+    void advance(size_t n) noexcept;
+    void pop() noexcept;
+    bool produceChunk(const Segment& s);
+
+    public:
+        bool empty() const noexcept { return mFirst == mSegments.size(); }
+
+        // serialized heads are appended here and queued with commitHead(<size before appending>)
+        MessageBuilder& headBuffer() noexcept { return mHeadBuffer; }
+        void commitHead(size_t start);
+
+        // queues `size` bytes without copying them, `owner` keeps them alive until they are written
+        void push(const void* data, size_t size, std::shared_ptr<const void> owner = nullptr);
+        // takes over `content` until it's written, leaving the memory of an earlier body in it
+        void push(std::string&& content);
+
+        // queues a part of a file, it's sent with sendfile
+        void pushFile(std::shared_ptr<const HttpFileBody> file, size_t offset, size_t size);
+
+        // queues a generated body, sent with chunked encoding unless `chunked` is false (the
+        // end of the connection ends the body then), `owner` keeps the producer alive
+        void pushProducer(const HttpBodyProducer* producer, std::shared_ptr<const void> owner = nullptr, bool chunked = true);
+        // the same, keeping the producer in the queue
+        void pushProducer(HttpBodyProducer&& producer, bool chunked = true);
+
+        void clear() noexcept;
+
+        // writes everything to a blocking stream
+        void flush(IClientStream& stream);
+
+        // writes as much as a non-blocking socket takes, false on errors (with errno set)
+        bool flush(int socket);
+};
+
+static_assert(MAX_HTTP_HEADERS < 255, "MAX_HTTP_HEADERS must fit the header slot indices");
+
+static inline constexpr char asciiToLower(char ch) noexcept {
+    return (ch >= 'A' && ch <= 'Z') ? ch + ('a' - 'A') : ch;
+}
+
+inline bool equalsIgnoreCase(std::string_view a, std::string_view b) noexcept {
+    if (a.size() != b.size())
+        return false;
+
+    for (size_t i = 0; i < a.size(); i++)
+        if (asciiToLower(a[i]) != asciiToLower(b[i]))
+            return false;
+
+    return true;
+}
+
+// Headers the library cares about, these have fixed slots in the header tables
+enum class HttpHeader : uint8_t {
+    Accept, AcceptRanges, CacheControl, Connection, ContentLength, ContentRange, ContentType,
+    Cookie, Date, ETag, Expect, Host, IfModifiedSince, IfNoneMatch, IfRange, KeepAlive,
+    LastModified, Location, Range, Server, SetCookie, TransferEncoding, Upgrade, UserAgent,
+    Unknown // also the number of well-known headers
+};
+
+// Canonical spelling of a well-known header
+std::string_view httpHeaderName(HttpHeader id) noexcept;
+// Case-insensitive, allocation free lookup through a precomputed hash table
+HttpHeader httpHeaderId(std::string_view name) noexcept;
+
+// Fixed capacity header storage. Well-known headers are found through their slot,
+// others by a case-insensitive scan. Clearing keeps the strings' memory around.
+class HttpHeaderTable {
+    public:
+        struct Entry {
+            HttpHeader id = HttpHeader::Unknown;
+            std::string customName, value;
 
-                mHeaders.insert(std::pair<std::string,std::string>(i, ""));
+            std::string_view name() const noexcept {
+                return id == HttpHeader::Unknown ? std::string_view{customName} : httpHeaderName(id);
             }
+        };
 
-            return mHeaders.find(i)->second;
+    private:
+        static constexpr uint8_t NoSlot = 0xFF;
+
+        Entry mEntries[MAX_HTTP_HEADERS];
+        size_t mCount = 0;
+        uint8_t mKnown[static_cast<size_t>(HttpHeader::Unknown)];
+
+        std::string& insert(HttpHeader id, std::string_view name) {
+            if (mCount >= MAX_HTTP_HEADERS)
+                throw std::runtime_error("too many HTTP headers");
+
+            Entry& e = mEntries[mCount];
+            e.id = id;
+            e.value.clear();
+
+            if (id == HttpHeader::Unknown)
+                e.customName.assign(name);
+            else
+                mKnown[static_cast<size_t>(id)] = static_cast<uint8_t>(mCount);
+
+            mCount++;
+            return e.value;
+        }
+
+    public:
+        HttpHeaderTable() noexcept { clear(); }
+
+        void clear() noexcept {
+            mCount = 0;
+            memset(mKnown, NoSlot, sizeof(mKnown));
         }
 
-        std::string operator[](std::string i) const {
-            std::transform(i.begin(), i.end(), i.begin(), [](unsigned char c){ return std::tolower(c); });
+        const std::string* find(HttpHeader id) const noexcept {
+            uint8_t slot = mKnown[static_cast<size_t>(id)];
+            return slot == NoSlot ? nullptr : &mEntries[slot].value;
+        }
 
-            auto f = mHeaders.find(i);
-            if (f == mHeaders.end())
-                return "";
+        const std::string* find(std::string_view name) const noexcept {
+            HttpHeader id = httpHeaderId(name);
+            if (id != HttpHeader::Unknown)
+                return find(id);
+
+            for (size_t i = 0; i < mCount; i++)
+                if (mEntries[i].id == HttpHeader::Unknown && equalsIgnoreCase(mEntries[i].customName, name))
+                    return &mEntries[i].value;
+
+            return nullptr;
+        }
+
+        std::string& get(HttpHeader id) {
+            uint8_t slot = mKnown[static_cast<size_t>(id)];
+            return slot == NoSlot ? insert(id, {}) : mEntries[slot].value;
+        }
+
+        std::string& get(std::string_view name) {
+            HttpHeader id = httpHeaderId(name);
+            if (id != HttpHeader::Unknown)
+                return get(id);
+
+            auto found = const_cast<std::string*>(find(name));
+            return found ? *found : insert(id, name);
+        }
+
+        const Entry* begin() const noexcept { return mEntries; }
+        const Entry* end() const noexcept { return mEntries + mCount; }
+};
+
+class HttpMessageCommon {
+    protected:
+        HttpHeaderTable mHeaders;
+        std::string mContent;
+
+    public:
+        std::string& operator[](std::string_view name) { return mHeaders.get(name); }
+        std::string& operator[](HttpHeader id) { return mHeaders.get(id); }
 
-            return mHeaders.find(i)->second;
+        std::string operator[](std::string_view name) const {
+            auto value = mHeaders.find(name);
+            return value ? *value : "";
         }
 
         void setContent(std::string content) {
             mContent = std::move(content);
-            (*this)["Content-Length"] = std::to_string(mContent.size());
+            (*this)[HttpHeader::ContentLength] = std::to_string(mContent.size());
         }
 
         const auto& content() const noexcept { return mContent; }
 };
 
+// Resumable HTTP/1.x request head parser. It works in place over the bytes of the
+// connection buffer: call parse() with everything buffered so far whenever more
+// data arrives, it continues where it stopped. Nothing is copied, the results are
+// offsets into the buffer, so the data may move between calls as long as the
+// request still starts at `data`.
+class HttpRequestParser {
+    public:
+        enum class Status { Incomplete, Complete, Error };
+
+        struct Span {
+            uint32_t offset = 0, length = 0;
+
+            std::string_view in(const char* base) const noexcept { return {base + offset, length}; }
+        };
+
+        struct Header {
+            Span name, value;
+        };
+
+    private:
+        enum class State { RequestLine, Headers, Done, Error };
+
+        State mState = State::RequestLine;
+        size_t mPos = 0;
+        Span mMethod, mTarget, mVersion;
+        Header mHeaders[MAX_HTTP_HEADERS];
+        size_t mHeaderCount = 0;
+
+        bool parseRequestLine(const char* data, size_t begin, size_t end) noexcept;
+        bool parseHeader(const char* data, size_t begin, size_t end) noexcept;
+
+    public:
+        // The longest head that can be valid: the request line, every header and the empty
+        // line, each of them CRLF terminated. Longer ones are an error.
+        static constexpr size_t sMaxHeadLength = (MAX_HTTP_HEADERS + 2) * (MAX_HTTP_LINE_LENGTH + 2);
+
+        Status parse(const char* data, size_t size) noexcept;
+        void reset() noexcept { *this = HttpRequestParser{}; }
+
+        // Length of the request head including the terminating empty line
+        size_t headLength() const noexcept { return mPos; }
+
+        const Span& method() const noexcept { return mMethod; }
+        const Span& target() const noexcept { return mTarget; }
+        const Span& version() const noexcept { return mVersion; }
+        const Header* headers() const noexcept { return mHeaders; }
+        size_t headerCount() const noexcept { return mHeaderCount; }
+};
+
+class HttpBodyReader;
+
+// Values of the :name segments of the route a request matched. Kept as offsets into the
+// path, so they stay valid when the request is moved.
+class HttpPathParams {
+    public:
+        struct Param {
+            std::string_view name;
+            size_t offset, length;
+        };
+
+    private:
+        Param mParams[MAX_PATH_PARAMS];
+        size_t mCount = 0;
+
+    public:
+        size_t size() const noexcept { return mCount; }
+        const Param& operator[](size_t i) const noexcept { return mParams[i]; }
+
+        const Param* find(std::string_view name) const noexcept {
+            for (size_t i = 0; i < mCount; ++i)
+                if (mParams[i].name == name)
+                    return &mParams[i];
+
+            return nullptr;
+        }
+
+        void push(std::string_view name, size_t offset, size_t length) noexcept { mParams[mCount++] = {name, offset, length}; }
+        void pop() noexcept { --mCount; }
+        void clear() noexcept { mCount = 0; }
+};
+
 class HttpRequest : public HttpMessageCommon {
     HttpRequestMethod mMethod = HttpRequestMethod::UNKNOWN;
     std::string path, query;
+    HttpBodyReader* mBodyReader = nullptr;
+    HttpPathParams mPathParams;
+
+    // the request head as received, the parsed parts point into it
+    std::string mHead;
+    HttpRequestParser::Span mMethodName;
+    uint8_t mVersionMajor = 1, mVersionMinor = 1;
+    HttpRequestParser::Header mRequestHeaders[MAX_HTTP_HEADERS];
+    size_t mRequestHeaderCount = 0;
+    uint8_t mKnownRequestHeaders[static_cast<size_t>(HttpHeader::Unknown)];
 
     #ifdef TINYHTTP_JSON
     miniJson::Json mContentJson;
     #endif
 
+    // called once mContent holds the body
+    void contentReceived();
+
     public:
+        // reads the head and the body
         bool parse(std::shared_ptr<IClientStream> stream);
+        // reads only the head, the body is left in the stream
+        bool parseHead(std::shared_ptr<IClientStream> stream);
+
+        // Takes over a head parsed from `head` (used by the event loop, which reads the
+        // body on its own), false if the method is not supported
+        bool parse(const HttpRequestParser& parser, const char* head);
+        size_t getContentLength() const;
+        void acceptContent(std::string content);
+        // the same, but copied into the memory the request already has
+        void acceptContent(const char* data, size_t size);
+        // reads the rest of `body` into content()
+        void receiveContent(HttpBodyReader& body);
+
+        // true if a body follows the head (a Content-Length above 0 or a chunked body)
+        bool hasBody() const noexcept;
+        bool isChunked() const noexcept { return !header(HttpHeader::TransferEncoding).empty(); }
+        bool expectsContinue() const noexcept { return equalsIgnoreCase(header(HttpHeader::Expect), "100-continue"); }
+
+        // reader of the body for streaming handlers, nullptr when the body was read into content()
+        HttpBodyReader* bodyReader() const noexcept { return mBodyReader; }
+        void attachBodyReader(HttpBodyReader* reader) noexcept { mBodyReader = reader; }
 
         const HttpRequestMethod& getMethod() const noexcept { return mMethod; }
+        std::string_view getMethodName() const noexcept { return mMethodName.in(mHead.data()); }
         const std::string& getPath() const noexcept { return path; }
         const std::string& getQuery() const noexcept { return query; }
+        // the first line of the request as received, without the CRLF
+        std::string_view requestLine() const noexcept { return std::string_view{mHead}.substr(0, mHead.find("\r\n")); }
+
+        // HTTP version from the request line, 1.0 if it had none
+        uint8_t versionMajor() const noexcept { return mVersionMajor; }
+        uint8_t versionMinor() const noexcept { return mVersionMinor; }
+
+        // true if the client keeps the connection open for another request: HTTP/1.1 does
+        // unless it sent "Connection: close", HTTP/1.0 only with "Connection: keep-alive"
+        bool keepAlive() const noexcept;
+
+        // value of the :name segment of the matched route, empty if there is none
+        std::string_view param(std::string_view name) const noexcept;
+        // the same parsed as an integer, nullopt if it's missing or not a number
+        std::optional<int64_t> paramInt(std::string_view name) const noexcept;
+
+        // filled by the router when the request is matched against a route
+        HttpPathParams& pathParams() noexcept { return mPathParams; }
+        const HttpPathParams& pathParams() const noexcept { return mPathParams; }
+
+        // Case-insensitive header lookup without copying, empty if the header is missing
+        std::string_view header(std::string_view name) const noexcept;
+        std::string_view header(HttpHeader id) const noexcept;
+
+        std::string operator[](std::string_view name) const { return std::string{header(name)}; }
 
         #ifdef TINYHTTP_JSON
         const miniJson::Json& json() const noexcept { return mContentJson; }
         #endif
 };
 
+// Reads a request body as it arrives, given to streaming handlers (see
+// HttpHandlerBuilder::streamed). Both Content-Length and chunked bodies are
+// supported, the size limit of the route is enforced while reading. A pending
+// "Expect: 100-continue" is answered by the first read, so a handler can reject
+// the request before the client sends the body.
+class HttpBodyReader {
+    IClientStream* mStream = nullptr;
+    const char* mMemory = nullptr; // bodies that were already received
+    size_t mLimit, mReceived = 0, mRemaining = 0; // left of the body or of the current chunk
+    bool mChunked = false, mInChunk = false, mFinished = false, mLimitExceeded = false, mContinuePending = false;
+
+    void nextChunk();
+
+    public:
+        // throws if the framing headers of the request are invalid
+        HttpBodyReader(IClientStream& stream, const HttpRequest& request, size_t limit);
+        explicit HttpBodyReader(const std::string& content) noexcept
+            : mMemory{content.data()}, mLimit{content.size()}, mRemaining{content.size()}, mFinished{content.empty()} {}
+
+        // reads at most `max` bytes, 0 once the body is over. Throws if the body is
+        // malformed, larger than the limit or the connection is lost.
+        size_t read(void* target, size_t max);
+        std::string readAll();
+        // appends the rest of the body to `content`
+        void readAll(std::string& content);
+
+        bool finished() const noexcept { return mFinished; }
+        bool limitExceeded() const noexcept { return mLimitExceeded; }
+        size_t received() const noexcept { return mReceived; }
+};
+
 struct ICanRequestProtocolHandover {
     virtual ~ICanRequestProtocolHandover() = default;
     virtual void acceptHandover(int& serverSock, IClientStream& client, std::unique_ptr<HttpRequest> srcRequest) = 0;
@@ -277,24 +894,133 @@ struct WebsockClientHandler {
 };
 #endif
 
+// Status line, headers and content serialized ahead of time, shared by every response sending them
+struct HttpPreparedResponse {
+    unsigned statusCode = 200;
+    MessageBuilder head; // without the empty line closing the headers
+    std::string content;
+
+    // validators of the content, also present in the head
+    std::string etag, lastModified;
+    time_t modified = 0;
+};
+
 class HttpResponse : public HttpMessageCommon {
     unsigned mStatusCode = 400;
     ICanRequestProtocolHandover* mHandover = nullptr;
+    std::shared_ptr<const HttpFileBody> mFile;
+    std::shared_ptr<const HttpPreparedResponse> mPrepared;
+    HttpBodyProducer mProducer;
 
     public:
-        HttpResponse(const unsigned statusCode) : mStatusCode{statusCode} {
-            (*this)["Server"] = "tinyHTTP_1.1";
+        // a range of the file sent after `prefix` (used for multipart headers)
+        struct FilePart {
+            std::string prefix;
+            size_t offset, length;
+        };
+
+    private:
+        std::vector<FilePart> mFileParts;
+
+    // the headers and the closing empty line. Server and Date are added from
+    // prebuilt lines unless they were set (an empty value leaves them out).
+    void serializeHeaders(MessageBuilder& out) const;
+
+    public:
+        HttpResponse(const unsigned statusCode) {
+            reset(statusCode);
+        }
+
+        // Back to an empty response, keeping the memory of the headers and the content.
+        // Used on the response object the server reuses for a connection.
+        void reset(const unsigned statusCode) {
+            mStatusCode = statusCode;
+            mHeaders.clear();
+            mContent.clear();
+            mHandover = nullptr;
+            mFile.reset();
+            mPrepared.reset();
+            mProducer = nullptr;
+            mFileParts.clear();
 
             if (statusCode >= 200)
-                (*this)["Content-Length"] = "0";
+                (*this)[HttpHeader::ContentLength] = "0";
+        }
+
+        // sets the content without giving up the memory the response already has
+        void setContent(std::string_view contentType, std::string_view content) {
+            (*this)[HttpHeader::ContentType] = contentType;
+            mContent.assign(content);
+            (*this)[HttpHeader::ContentLength] = std::to_string(mContent.size());
+        }
+
+        using HttpMessageCommon::setContent;
+
+        unsigned statusCode() const noexcept { return mStatusCode; }
+        // size of the body as announced in the head, -1 for chunked and unknown lengths
+        long long contentLength() const noexcept;
+        // true if the body is sent with chunked transfer encoding
+        bool isChunked() const noexcept {
+            auto value = mHeaders.find(HttpHeader::TransferEncoding);
+            return value && !value->empty();
         }
 
         HttpResponse(const unsigned statusCode, std::string contentType, std::string content)
             : HttpResponse{statusCode} {
-            (*this)["Content-Type"] = contentType;
+            (*this)[HttpHeader::ContentType] = contentType;
             setContent(content);
         }
 
+        // the body is sent from the file without reading it into memory
+        HttpResponse(const unsigned statusCode, std::string contentType, std::shared_ptr<const HttpFileBody> file)
+            : HttpResponse{statusCode} {
+            (*this)[HttpHeader::ContentType] = contentType;
+            setFile(std::move(file));
+        }
+
+        void setFile(std::shared_ptr<const HttpFileBody> file) {
+            mContent.clear();
+            mFileParts.clear();
+            mFile = std::move(file);
+            (*this)[HttpHeader::ContentLength] = std::to_string(mFile ? mFile->length() : 0);
+        }
+
+        // sends only the given parts of the file
+        void setFile(std::shared_ptr<const HttpFileBody> file, std::vector<FilePart> parts) {
+            size_t length = 0;
+            for (auto& part : parts)
+                length += part.prefix.size() + part.length;
+
+            setFile(std::move(file));
+            mFileParts = std::move(parts);
+            (*this)[HttpHeader::ContentLength] = std::to_string(length);
+        }
+
+        const std::shared_ptr<const HttpFileBody>& file() const noexcept { return mFile; }
+
+        // the body is generated while it's sent, in chunks of at most TINYHTTP_CHUNK_SIZE
+        // bytes, using chunked transfer encoding. The producer runs on the thread serving
+        // the connection (an event loop thread in that mode), so it shouldn't block for long.
+        HttpResponse(const unsigned statusCode, std::string contentType, HttpBodyProducer producer)
+            : HttpResponse{statusCode} {
+            (*this)[HttpHeader::ContentType] = contentType;
+            setProducer(std::move(producer));
+        }
+
+        void setProducer(HttpBodyProducer producer) {
+            mContent.clear();
+            mFile.reset();
+            mFileParts.clear();
+            mProducer = std::move(producer);
+            (*this)[HttpHeader::ContentLength] = "";
+            (*this)[HttpHeader::TransferEncoding] = "chunked";
+        }
+
+        // sends the prepared head and content without copying them,
+        // headers set on this response are added after the prepared ones
+        explicit HttpResponse(std::shared_ptr<const HttpPreparedResponse> prepared)
+            : mStatusCode{prepared->statusCode}, mPrepared{std::move(prepared)} {}
+
         inline void requestProtocolHandover(ICanRequestProtocolHandover* newOwner) noexcept {
             mHandover = newOwner;
         }
@@ -319,29 +1045,109 @@ class HttpResponse : public HttpMessageCommon {
             : HttpResponse{statusCode, "text/html", _template.render()} {}
         #endif
 
-        MessageBuilder buildMessage() {
-            MessageBuilder b;
+        // appends the status line and the headers, without the content
+        void serializeHead(MessageBuilder& out) const;
 
-            b.write("HTTP/1.1 " + std::to_string(mStatusCode));
-            b.writeCRLF();
+        // queues the head and the content, the content is not copied so
+        // `owner` has to keep the response alive until it's written
+        void enqueue(OutputQueue& out, std::shared_ptr<const void> owner = nullptr) const;
 
-            for (auto& h : mHeaders)
-                if (!h.second.empty())
-                    b.write(h.first + ": " + h.second + "\r\n");
+        // Queues the response without referencing it: small contents are copied next to the
+        // head, larger ones and producers are moved into the queue. The object can be reset
+        // for the next request right after.
+        void moveInto(OutputQueue& out);
+
+        // the whole message in one buffer, file and produced bodies are not included
+        MessageBuilder buildMessage() const {
+            MessageBuilder b;
 
-            b.writeCRLF();
-            b.write(mContent);
+            serializeHead(b);
+            b.write(mPrepared ? mPrepared->content : mContent);
 
             return b;
         }
 };
 
+// Opt-in cache of small static files for serveFile and serveFromFolder. Entries hold
+// the content and a prepared head, the least recently used ones are dropped to stay
+// within the memory budget. The directories of cached files are watched with inotify
+// and changed files are dropped, so a hit doesn't touch the filesystem at all.
+class HttpFileCache {
+    struct Entry {
+        std::string path;
+        std::shared_ptr<const HttpPreparedResponse> response;
+        size_t cost;
+    };
+
+    size_t mBudget, mMaxFileSize, mUsed = 0;
+    std::list<Entry> mLru; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> mEntries;
+    std::multimap<int, std::string> mWatches; // inotify watch descriptor -> every spelling of its directory
+    int mInotify = -1;
+    uint64_t mGeneration = 0; // bumped by every change, loads racing with one aren't cached
+
+    bool watchDirectory(const std::string& path);
+    void processEvents();
+    void invalidate(const std::string& path);
+    void invalidateDirectory(const std::string& dir);
+
+    #ifdef TINYHTTP_THREADING
+    std::mutex mMutex;
+    std::unique_ptr<std::thread> mWatcherThread;
+    int mWakeFd = -1;
+    bool mShutdown = false;
+
+    void watcherThreadProc();
+    #else
+    // lookups pick up the changes themselves, at most once per tick
+    std::chrono::steady_clock::time_point mNextDrain;
+    #endif
+
+    public:
+        // files larger than `maxFileSize` are never cached, they are sent with sendfile
+        HttpFileCache(size_t budget, size_t maxFileSize = 1024*1024);
+        ~HttpFileCache();
+        HttpFileCache(const HttpFileCache&) = delete;
+        HttpFileCache& operator=(const HttpFileCache&) = delete;
+
+        // nullptr if the file is not cached
+        std::shared_ptr<const HttpPreparedResponse> find(const std::string& path);
+
+        // reads the file into the cache, nullptr if it can't be opened, isn't a regular
+        // file or is too large
+        std::shared_ptr<const HttpPreparedResponse> load(const std::string& path, const std::string& mimeType);
+
+        // files above this size aren't worth calling load() for
+        size_t maxFileSize() const noexcept { return mMaxFileSize; }
+
+        size_t memoryUsed();
+};
+
 struct HandlerBuilder {
     virtual ~HandlerBuilder() = default;
 
+    // slot of the route in HttpMetrics, set by HttpServer when the handler is registered
+    size_t metricsRoute = 0;
+
+    // above 0 if the handler reads the body of `req` itself through an HttpBodyReader,
+    // accepting up to that many bytes. Otherwise the body is read into content() first.
+    virtual size_t bodyLimit(const HttpRequest& /* req */) const { return 0; }
+
     virtual std::unique_ptr<HttpResponse> process(const HttpRequest& req) {
         return nullptr;
     }
+
+    // Fills `res`, the response object the server reuses for every request of a connection
+    // (reset to a 200 before the call). False if there is no answer, the default goes
+    // through process(req).
+    virtual bool process(const HttpRequest& req, HttpResponse& res) {
+        auto r = process(req);
+        if (!r)
+            return false;
+
+        res = std::move(*r);
+        return true;
+    }
 };
 
 #ifdef TINYHTTP_WS
@@ -377,115 +1183,782 @@ class WebsockHandlerBuilder : public HandlerBuilder, public ICanRequestProtocolH
 
 class HttpHandlerBuilder : public HandlerBuilder {
     typedef std::function<HttpResponse(const HttpRequest&)> HandlerFunc;
+    typedef std::function<void(const HttpRequest&, HttpResponse&)> WriterFunc;
+    typedef std::function<HttpResponse(const HttpRequest&, HttpBodyReader&)> StreamHandlerFunc;
 
-    std::map<HttpRequestMethod, HandlerFunc> mHandlers;
+    std::map<HttpRequestMethod, WriterFunc> mHandlers;
+    std::map<HttpRequestMethod, std::pair<size_t, StreamHandlerFunc>> mStreamHandlers;
 
     static bool isSafeFilename(const std::string& name, bool allowSlash);
     static std::string getMimeType(std::string name);
+    static bool isNotModified(const HttpRequest& req, std::string_view etag, time_t modified);
+    static HttpResponse notModified(std::string etag, std::string lastModified);
+    static std::optional<HttpResponse> cachedResponse(const HttpRequest& req, const std::string& path, HttpFileCache& cache);
+    static std::optional<HttpResponse> rangeResponse(const HttpRequest& req, std::shared_ptr<HttpFileBody> file, const std::string& mimeType);
+    static HttpResponse fileResponse(const HttpRequest& req, const std::string& path, HttpFileCache* cache);
 
     public:
         HttpHandlerBuilder* posted(HandlerFunc h) {
-            mHandlers.insert(std::pair<HttpRequestMethod, HandlerFunc>(HttpRequestMethod::POST, std::move(h)));
-            return this;
+            return posted([h = std::move(h)](const HttpRequest& req, HttpResponse& res) { res = h(req); });
         }
 
         HttpHandlerBuilder* requested(HandlerFunc h) {
-            mHandlers.insert(std::pair<HttpRequestMethod, HandlerFunc>(HttpRequestMethod::GET, std::move(h)));
+            return requested([h = std::move(h)](const HttpRequest& req, HttpResponse& res) { res = h(req); });
+        }
+
+        // Handlers filling the response object of the connection instead of returning a new
+        // one, it keeps the memory of its headers and content between requests
+        HttpHandlerBuilder* posted(WriterFunc h) {
+            mHandlers.insert(std::pair<HttpRequestMethod, WriterFunc>(HttpRequestMethod::POST, std::move(h)));
             return this;
         }
 
-        HttpHandlerBuilder* serveFile(std::string name) {
-            return requested([name](const HttpRequest&) {
-                std::ifstream t(name);
-                if (t.is_open())
-                    return HttpResponse{200, getMimeType(name), std::string((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>())};
-                else {
-                    std::cerr << "Could not locate file: " << name << std::endl;
-                    return HttpResponse{404, "text/plain", "The requested file is missing from the server"};
+        HttpHandlerBuilder* requested(WriterFunc h) {
+            mHandlers.insert(std::pair<HttpRequestMethod, WriterFunc>(HttpRequestMethod::GET, std::move(h)));
+            return this;
+        }
+
+        HttpHandlerBuilder* serveFile(std::string name, std::shared_ptr<HttpFileCache> cache = nullptr) {
+            return requested([name, cache](const HttpRequest& q) {
+                if (cache) {
+                    auto cached = cachedResponse(q, name, *cache);
+                    if (cached)
+                        return std::move(*cached);
                 }
+
+                return fileResponse(q, name, cache.get());
             });
         }
 
-        HttpHandlerBuilder* serveFromFolder(std::string dir) {
-            return requested([dir](const HttpRequest&q) {
+        // answers with the counters of HttpMetrics in the Prometheus text format
+        HttpHandlerBuilder* serveMetrics();
+
+        HttpHandlerBuilder* serveFromFolder(std::string dir, std::shared_ptr<HttpFileCache> cache = nullptr) {
+            return requested([dir, cache](const HttpRequest&q) {
                 std::string fname = q.getPath();
                 fname = fname.substr(fname.rfind('/')+1);
+                std::string path = dir + "/" + fname;
 
-                if (isSafeFilename(fname, false)) {
-                    fname = dir + "/" + fname;
-
-                    std::ifstream t(fname);
-                    if (t.is_open())
-                        return HttpResponse{200, getMimeType(fname), std::string((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>())};
-                    else
-                        std::cerr << "Could not locate file: " << fname << std::endl;
+                // only safe names ever make it into the cache
+                if (cache) {
+                    auto cached = cachedResponse(q, path, *cache);
+                    if (cached)
+                        return std::move(*cached);
                 }
 
+                if (isSafeFilename(fname, false))
+                    return fileResponse(q, path, cache.get());
+
                 return HttpResponse{404, "text/plain", "The requested file is missing from the server"};
             });
         }
 
+        // The handler gets the body as it arrives instead of the whole of it in content().
+        // Bodies larger than `maxBodySize` are answered with "413 Payload Too Large".
+        HttpHandlerBuilder* streamed(HttpRequestMethod method, size_t maxBodySize, StreamHandlerFunc h) {
+            mStreamHandlers.insert({method, {maxBodySize, std::move(h)}});
+            return this;
+        }
+
+        HttpHandlerBuilder* postedStream(size_t maxBodySize, StreamHandlerFunc h) {
+            return streamed(HttpRequestMethod::POST, maxBodySize, std::move(h));
+        }
+
+        size_t bodyLimit(const HttpRequest& req) const override {
+            auto h = mStreamHandlers.find(req.getMethod());
+            return h == mStreamHandlers.end() ? 0 : h->second.first;
+        }
+
         template<typename T>
         inline HttpHandlerBuilder* posted(T x) {
-            return posted(HandlerFunc(std::move(x)));
+            if constexpr (std::is_invocable_v<T&, const HttpRequest&, HttpResponse&>)
+                return posted(WriterFunc(std::move(x)));
+            else
+                return posted(HandlerFunc(std::move(x)));
         }
 
         template<typename T>
         inline HttpHandlerBuilder* requested(T x) {
-            return requested(HandlerFunc(std::move(x)));
+            if constexpr (std::is_invocable_v<T&, const HttpRequest&, HttpResponse&>)
+                return requested(WriterFunc(std::move(x)));
+            else
+                return requested(HandlerFunc(std::move(x)));
         }
 
-        std::unique_ptr<HttpResponse> process(const HttpRequest& req) override {
+        bool process(const HttpRequest& req, HttpResponse& res) override {
+            auto sh = mStreamHandlers.find(req.getMethod());
+            if (sh != mStreamHandlers.end()) {
+                if (req.bodyReader()) {
+                    res = sh->second.second(req, *req.bodyReader());
+                } else {
+                    // the body was received already (or there is none)
+                    HttpBodyReader body{req.content()};
+                    res = sh->second.second(req, body);
+                }
+
+                return true;
+            }
+
             auto h = mHandlers.find(req.getMethod());
 
-            if (h == mHandlers.end())
-                return std::make_unique<HttpResponse>(405, "text/plain", "405 method not allowed");
-            else
-                return std::make_unique<HttpResponse>(h->second(req));
+            if (h == mHandlers.end()) {
+                res.reset(405);
+                res.setContent("text/plain", "405 method not allowed");
+            } else
+                h->second(req, res);
+
+            return true;
+        }
+
+        std::unique_ptr<HttpResponse> process(const HttpRequest& req) override {
+            auto res = std::make_unique<HttpResponse>(200);
+            process(req, *res);
+            return res;
         }
 };
 
-class HttpServer {
-    std::vector<std::pair<std::string, std::shared_ptr<HandlerBuilder>>> mHandlers;
-    std::vector<std::pair<std::regex, std::shared_ptr<HandlerBuilder>>> mReHandlers;
-    MessageBuilder mDefault404Message, mDefault400Message;
-    int mSocket = -1;
-    bool mCleanupThreadShutdown = false;
+// Route table of the server. Exact paths are looked up in a hash map, routes with :name
+// segments in a tree of path segments, and patterns by the literal prefix they start with
+// in a radix trie, so only routes that can match the path are tested. Common pattern tails
+// like "[^/]+" or ".*" are matched without the regex engine.
+class HttpRouter {
+    public:
+        using Handler = std::shared_ptr<HandlerBuilder>;
+
+    private:
+        // what has to follow the literal prefix of a pattern
+        enum class Tail {
+            Exact,       // nothing
+            Segment,     // [^/]+
+            OptSegment,  // [^/]*
+            Any,         // .*
+            AnyNonEmpty, // .+
+            Regex        // anything else, the whole path is matched against the regex
+        };
+
+        struct Pattern {
+            std::string prefix;
+            Tail tail;
+            std::regex regex;
+            Handler handler;
+        };
+
+        struct Node {
+            std::string label;
+            std::vector<std::unique_ptr<Node>> children;
+            std::vector<size_t> patterns;
+        };
+
+        // what a :name<type> segment accepts
+        enum class ParamType {
+            Segment, // any non-empty segment (no type given)
+            Int,     // decimal integer fitting int64_t
+            Uuid,    // 8-4-4-4-12 hex digits
+            Slug,    // letters, digits, '-' and '_'
+            Rest     // the rest of the path, slashes included
+        };
+
+        struct SegmentNode {
+            struct Param {
+                ParamType type;
+                std::string name;
+                std::unique_ptr<SegmentNode> next;
+            };
+
+            std::map<std::string, std::unique_ptr<SegmentNode>, std::less<>> literals;
+            std::vector<Param> params;
+            std::vector<Handler> handlers;
+        };
+
+        // patterns collected for one lookup, above this every pattern is checked by its prefix
+        static constexpr size_t sMaxCandidates = 64;
+
+        std::unordered_map<std::string, std::vector<Handler>> mExact;
+        std::vector<Pattern> mPatterns;
+        Node mRoot;
+        SegmentNode mSegments;
+
+        static bool matches(const Pattern& pattern, const std::string& path);
+        static bool paramMatches(ParamType type, std::string_view value);
+
+        // indices of the patterns whose prefix starts `path` in registration order,
+        // returns sMaxCandidates+1 if there are more than fit `out`
+        size_t collect(const std::string& path, size_t* out) const;
+
+        // walks the segment tree from the segment starting at `pos`, literal segments before
+        // parameters. `pos` is past the end of `path` once every segment is consumed.
+        template<typename Visitor>
+        bool visitSegments(const SegmentNode& node, std::string_view path, size_t pos, HttpPathParams& params, Visitor& visitor) const {
+            if (pos > path.size()) {
+                for (auto& h : node.handlers)
+                    if (visitor(h))
+                        return true;
+
+                return false;
+            }
 
-    std::shared_ptr<HttpResponse> processRequest(std::string key, const HttpRequest& req) {
-        try {
-            for (auto& x : mHandlers)
-                if (x.first == key) {
-                    auto res = x.second->process(req);
-                    if (res) return res;
+            size_t end = path.find('/', pos);
+            if (end == std::string_view::npos)
+                end = path.size();
+
+            std::string_view segment = path.substr(pos, end-pos);
+
+            auto it = node.literals.find(segment);
+            if (it != node.literals.end() && visitSegments(*it->second, path, end+1, params, visitor))
+                return true;
+
+            for (auto& p : node.params) {
+                bool rest = p.type == ParamType::Rest;
+                if (!rest && !paramMatches(p.type, segment))
+                    continue;
+
+                params.push(p.name, pos, rest ? path.size()-pos : segment.size());
+                if (visitSegments(*p.next, path, rest ? path.size()+1 : end+1, params, visitor))
+                    return true;
+
+                params.pop();
+            }
+
+            return false;
+        }
+
+    public:
+        // Routes with segments like ":id" or ":id<int>" go to the segment tree, see README.
+        // `front` puts the handler before the others registered for the same path.
+        void add(std::string path, Handler handler, bool front = false);
+        void addPattern(const std::string& pattern, Handler handler);
+
+        // calls `visitor` with each handler matching `path` until it returns true, exact routes
+        // first, then the ones with parameters and patterns last, each in registration order.
+        // The values of :name segments are in `params` while the visitor runs.
+        template<typename Visitor>
+        bool visit(const std::string& path, Visitor&& visitor, HttpPathParams* params = nullptr) const {
+            HttpPathParams scratch;
+            if (!params)
+                params = &scratch;
+
+            params->clear();
+
+            auto it = mExact.find(path);
+            if (it != mExact.end())
+                for (auto& h : it->second)
+                    if (visitor(h))
+                        return true;
+
+            if (!path.empty() && path[0] == '/' && visitSegments(mSegments, path, 1, *params, visitor))
+                return true;
+
+            if (mPatterns.empty())
+                return false;
+
+            size_t found[sMaxCandidates];
+            size_t count = collect(path, found);
+
+            if (count <= sMaxCandidates) {
+                for (size_t i = 0; i < count; ++i) {
+                    auto& p = mPatterns[found[i]];
+                    if (matches(p, path) && visitor(p.handler))
+                        return true;
                 }
+            } else {
+                for (auto& p : mPatterns)
+                    if (path.compare(0, p.prefix.size(), p.prefix) == 0 && matches(p, path) && visitor(p.handler))
+                        return true;
+            }
+
+            return false;
+        }
+};
+
+enum class HttpLogLevel { Error = 1, Info, Debug };
+enum class HttpLogFormat { Common, Combined, Json };
+
+// Log output of the library. A thread claims one of a fixed set of ring buffers on its first
+// line and formats into it without taking locks, a background thread writes them out (to
+// stdout, errors to stderr) or hands them to a sink. Rings are given back when their thread
+// exits, threads beyond the set share a ring behind a mutex. Lines that don't fit a full
+// ring are dropped and counted instead of waiting for the writer. Messages above
+// TINYHTTP_LOG_LEVEL are compiled out.
+class HttpLogger {
+    public:
+        // called on the writer thread for each line, without the newline
+        typedef std::function<void(HttpLogLevel level, std::string_view line)> Sink;
+
+    private:
+        struct Ring;
+
+        std::atomic<HttpLogLevel> mLevel{static_cast<HttpLogLevel>(TINYHTTP_LOG_LEVEL)};
+        std::atomic<HttpLogFormat> mFormat{HttpLogFormat::Common};
+        std::atomic<unsigned> mSampling{1};
+        std::atomic<size_t> mDropped{0};
+        Sink mSink;
+
+        #ifdef TINYHTTP_THREADING
+        struct Slot {
+            std::atomic<bool> claimed{false};
+            std::atomic<Ring*> ring{nullptr}; // allocated on the first line logged into the slot
+        };
+
+        // gives the slot of the thread back when it exits
+        struct Claim {
+            Slot* slot = nullptr;
+            ~Claim() { if (slot) slot->claimed.store(false, std::memory_order_release); }
+        };
+
+        // slot of the current thread, claimed on its first line
+        inline static thread_local Slot* sSlot = nullptr;
+
+        std::mutex mMutex; // the writer thread
+        std::mutex mDrainMutex; // only one thread empties the rings at a time, also guards the sink
+        std::mutex mOverflowMutex; // writers of the shared ring
+        Slot mSlots[TINYHTTP_LOG_RINGS];
+        Slot mOverflow; // shared by the threads that found every slot taken
+        std::atomic<size_t> mNextSlot{0};
+        std::unique_ptr<std::thread> mWriterThread;
+        std::condition_variable mWakeup;
+        bool mShutdown = false;
+        std::string mOut, mErr;
+
+        Slot& claimSlot();
+        Ring& ringOf(Slot& slot);
+        void pushInto(Ring& ring, HttpLogLevel level, const char* line, size_t length);
+        void writerThreadProc();
+        #endif
+
+        HttpLogger() = default;
+        void push(HttpLogLevel level, const char* line, size_t length);
+
+    public:
+        ~HttpLogger();
+        HttpLogger(const HttpLogger&) = delete;
+        HttpLogger& operator=(const HttpLogger&) = delete;
+
+        static HttpLogger& instance();
+
+        // nullptr restores the default output
+        void setSink(Sink sink);
+        // filters at runtime, levels above TINYHTTP_LOG_LEVEL can't be turned on
+        void setLevel(HttpLogLevel level) noexcept { mLevel = level; }
+        void setFormat(HttpLogFormat format) noexcept { mFormat = format; }
+        // only every n-th request of a thread goes to the access log, errors are always kept
+        void setSampling(unsigned everyNth) noexcept { mSampling = everyNth > 0 ? everyNth : 1; }
+
+        bool enabled(HttpLogLevel level) const noexcept {
+            return static_cast<int>(level) <= TINYHTTP_LOG_LEVEL && level <= mLevel.load(std::memory_order_relaxed);
+        }
+
+        // lines dropped because the ring of their thread was full
+        size_t dropped() const noexcept { return mDropped; }
+
+        void log(HttpLogLevel level, const char* format, ...) __attribute__((format(printf, 3, 4)));
+        // one access log line, `bytes` is the body size or -1 if it's not known up front
+        void access(const HttpRequest& req, std::string_view peer, unsigned statusCode, long long bytes);
+
+        // writes out everything logged so far
+        void flush();
+};
+
+#define TINYHTTP_LOG(level, ...) \
+    do { if constexpr (static_cast<int>(level) <= TINYHTTP_LOG_LEVEL) HttpLogger::instance().log(level, __VA_ARGS__); } while (0)
+
+#define TINYHTTP_LOG_ERROR(...) TINYHTTP_LOG(HttpLogLevel::Error, __VA_ARGS__)
+#define TINYHTTP_LOG_DEBUG(...) TINYHTTP_LOG(HttpLogLevel::Debug, __VA_ARGS__)
+
+#ifdef TINYHTTP_METRICS
+// Counters of the server: requests by route, method and status class with latency
+// histograms per route, traffic, connections, handovers and rejected requests. A thread
+// claims one of a fixed set of shards on its first count and updates it with plain stores,
+// shards are only summed up when the metrics are rendered. A shard keeps its counts when
+// its thread exits and the next thread claiming it counts on from there.
+class HttpMetrics {
+    public:
+        // log-linear latency buckets in microseconds with two of them for each power of two
+        // (1, 2, 3, 4, 6, 8, 12, 16...), the last one takes everything above ~67s
+        static constexpr size_t sLatencyBuckets = 53;
+
+    private:
+        // set when every shard was taken and the thread counts into the shared overflow one
+        inline static thread_local bool sShared = false;
+
+        // only written by the thread holding the shard, except in the overflow shard
+        struct Counter {
+            std::atomic<uint64_t> value{0};
+
+            void add(uint64_t n) noexcept {
+                if (sShared)
+                    value.fetch_add(n, std::memory_order_relaxed);
+                else
+                    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+
+            uint64_t get() const noexcept { return value.load(std::memory_order_relaxed); }
+        };
+
+        static constexpr size_t sMethods = static_cast<size_t>(HttpRequestMethod::UNKNOWN) + 1;
+        static constexpr size_t sStatusClasses = 5; // 1xx to 5xx
+
+        struct Route {
+            Counter requests[sMethods][sStatusClasses];
+            Counter latency[sLatencyBuckets];
+            Counter latencySum; // microseconds
+        };
+
+        struct Shard {
+            Counter bytesIn, bytesOut;
+            Counter connectionsOpened, connectionsClosed;
+            Counter handoversStarted, handoversEnded;
+            Counter parseErrors, notFound;
+            Counter shed[3]; // by HttpShedReason
+            Route routes[TINYHTTP_METRICS_MAX_ROUTES];
+
+            void addTo(Shard& total) const noexcept;
+        };
+
+        // shard of the current thread, claimed on first use
+        inline static thread_local Shard* sShard = nullptr;
+
+        struct Slot {
+            std::atomic<bool> claimed{false};
+            std::atomic<Shard*> shard{nullptr}; // allocated by the first thread claiming the slot
+        };
+
+        // gives the slot of the thread back when it exits
+        struct Claim {
+            Slot* slot = nullptr;
+            ~Claim() { if (slot) slot->claimed.store(false, std::memory_order_release); }
+        };
+
+        #ifdef TINYHTTP_THREADING
+        std::mutex mMutex; // guards mRoutes
+        #endif
+        Slot mSlots[TINYHTTP_METRICS_SHARDS];
+        std::atomic<size_t> mNextSlot{0};
+        Shard mOverflow;
+        std::vector<std::string> mRoutes; // labels by slot, slot 0 is "other"
+
+        HttpMetrics();
+        ~HttpMetrics();
+        Shard& shard() { return sShard ? *sShard : claimShard(); }
+        Shard& claimShard();
+
+    public:
+        HttpMetrics(const HttpMetrics&) = delete;
+        HttpMetrics& operator=(const HttpMetrics&) = delete;
+
+        static HttpMetrics& instance();
+
+        // slot of the route with this label, registered on first use
+        size_t route(const std::string& label);
 
-            for (auto x : mReHandlers)
-                if (std::regex_match(key, x.first)) {
-                    auto res = x.second->process(req);
-                    if (res) return res;
+        void bytesIn(size_t n) { shard().bytesIn.add(n); }
+        void bytesOut(size_t n) { shard().bytesOut.add(n); }
+        void connectionOpened() { shard().connectionsOpened.add(1); }
+        void connectionClosed() { shard().connectionsClosed.add(1); }
+        void handoverStarted() { shard().handoversStarted.add(1); }
+        void handoverEnded() { shard().handoversEnded.add(1); }
+        void parseError() { shard().parseErrors.add(1); }
+        void notFound() { shard().notFound.add(1); }
+        void shed(HttpShedReason reason) { shard().shed[static_cast<size_t>(reason)].add(1); }
+
+        // a request answered by the handler in `route` in `elapsed` time
+        void request(size_t route, HttpRequestMethod method, unsigned statusCode, std::chrono::steady_clock::duration elapsed);
+
+        // appends everything in the Prometheus text format
+        void render(std::string& out);
+};
+
+#define TINYHTTP_METRIC(call) HttpMetrics::instance().call
+#else
+#define TINYHTTP_METRIC(call) do {} while (0)
+#endif
+
+// Hierarchical timer wheel. Timers sit in slots by the tick they expire at, so arming,
+// re-arming and cancelling are O(1) and advancing only visits the slots that passed.
+// Timers further away are kept on the upper levels and cascade down as their time gets
+// closer. A wheel isn't thread safe, it belongs to the thread driving it.
+class HttpTimerWheel {
+    public:
+        typedef std::chrono::steady_clock Clock;
+
+        // intrusive node, embedded into whatever is timed
+        class Timer {
+            friend class HttpTimerWheel;
+
+            Timer* mPrev = nullptr;
+            Timer* mNext = nullptr;
+            HttpTimerWheel* mWheel = nullptr;
+            uint64_t mExpires = 0; // tick
+
+            void unlink() noexcept;
+
+            public:
+                Timer() = default;
+                Timer(const Timer&) = delete;
+                Timer& operator=(const Timer&) = delete;
+                ~Timer() { if (mWheel) mWheel->cancel(*this); }
+
+                bool armed() const noexcept { return mWheel != nullptr; }
+        };
+
+    private:
+        static constexpr unsigned sLevelBits = 6;
+        static constexpr size_t sSlots = 1 << sLevelBits;
+        static constexpr unsigned sLevels = 4; // 64^4 ticks, timers further away wait on the last level
+
+        Clock::duration mResolution;
+        Clock::time_point mStart;
+        uint64_t mNow = 0; // current tick
+        size_t mCount = 0;
+        Timer mSlots[sLevels][sSlots]; // list heads
+
+        void insert(Timer& t) noexcept;
+        // moves the timers of a slot on `level` down to where they belong now
+        void cascade(unsigned level) noexcept;
+
+    public:
+        explicit HttpTimerWheel(Clock::duration resolution);
+        ~HttpTimerWheel();
+        HttpTimerWheel(const HttpTimerWheel&) = delete;
+        HttpTimerWheel& operator=(const HttpTimerWheel&) = delete;
+
+        // (re)arms the timer, it expires on the first tick at or after `when`
+        void arm(Timer& t, Clock::time_point when) noexcept;
+        void cancel(Timer& t) noexcept;
+
+        size_t size() const noexcept { return mCount; }
+
+        // time until the next tick that may expire a timer, for poll timeouts (-1 ms if none is armed)
+        std::chrono::milliseconds nextTimeout(Clock::time_point now) const noexcept;
+
+        // Calls `expired(timer)` for every timer due at `now`, after disarming it. The callback
+        // may arm or cancel any timer, the one it got included.
+        template<typename F>
+        void advance(Clock::time_point now, F&& expired) {
+            uint64_t target = (now - mStart) / mResolution;
+
+            while (mNow < target) {
+                mNow++;
+
+                size_t slot = mNow & (sSlots - 1);
+                if (slot == 0)
+                    cascade(1);
+
+                // detached first, so the callbacks can't change the list being walked
+                Timer pending;
+                Timer& head = mSlots[0][slot];
+                if (head.mNext == &head)
+                    continue;
+
+                pending.mNext = head.mNext;
+                pending.mPrev = head.mPrev;
+                pending.mNext->mPrev = &pending;
+                pending.mPrev->mNext = &pending;
+                head.mNext = head.mPrev = &head;
+
+                while (pending.mNext != &pending) {
+                    Timer& t = *pending.mNext;
+                    t.unlink();
+                    t.mWheel = nullptr;
+                    mCount--;
+
+                    expired(t);
                 }
+            }
+        }
+};
+
+// Lock-free stack many threads push to and one thread empties at once, in push order
+template<typename T>
+class HttpEventStack {
+    struct Node {
+        T value;
+        Node* next;
+    };
+
+    std::atomic<Node*> mHead{nullptr};
+
+    public:
+        HttpEventStack() = default;
+        HttpEventStack(const HttpEventStack&) = delete;
+        HttpEventStack& operator=(const HttpEventStack&) = delete;
+
+        ~HttpEventStack() {
+            drain([](T&&) {});
+        }
+
+        void push(T value) {
+            Node* node = new Node{std::move(value), mHead.load(std::memory_order_relaxed)};
+            while (!mHead.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        template<typename F>
+        void drain(F&& handler) {
+            Node* node = mHead.exchange(nullptr, std::memory_order_acquire);
+
+            // the newest is on top
+            Node* ordered = nullptr;
+            while (node) {
+                Node* next = node->next;
+                node->next = ordered;
+                ordered = node;
+                node = next;
+            }
+
+            while (ordered) {
+                std::unique_ptr<Node> current{ordered};
+                ordered = ordered->next;
+                handler(std::move(current->value));
+            }
+        }
+};
+
+#ifdef TINYHTTP_THREADING
+// What the server does with new connections while every pool worker is busy and the queue is full
+enum class HttpOverloadPolicy {
+    Reject, // answer with "503 Service Unavailable" and close
+    Block   // stop accepting until there is room, leaving clients in the listen backlog
+};
+#endif
+
+#ifdef TINYHTTP_EPOLL
+// Where event loop threads run
+enum class HttpCpuAffinity {
+    None,   // wherever the scheduler puts them
+    Pinned, // each loop on its own CPU, in the order of the process affinity mask
+    Numa    // like Pinned, but taking the CPUs from the NUMA nodes in turn
+};
+#endif
+
+class HttpServer {
+    HttpRouter mRouter;
+    MessageBuilder mDefault404Message, mDefault400Message, mDefault413Message, mDefault503Message;
+    MessageBuilder mDefault404KeepAliveMessage, mDefault404CloseMessage; // with a Connection header
+    int mSocket = -1;
+    int mListenBacklog = SOMAXCONN;
+    HttpConnectionLimits mLimits;
+    size_t mMaxRequestsPerConnection = 0;
+    int mIdleTimeout = TINYHTTP_CLIENT_TIMEOUT;
+    std::atomic<bool> mTimerThreadShutdown{false};
+
+    // Whether the connection stays open after answering `req` with its `served`th response.
+    // `res` is told the same in its Connection header, and loses its chunked encoding if the
+    // client doesn't understand it. nullptr for the prebuilt responses, which can't be changed.
+    bool keepConnection(const HttpRequest& req, HttpResponse* res, size_t served) const;
+
+    // the prebuilt 404 carrying the Connection header keepConnection() would have set
+    const MessageBuilder& notFoundMessage(const HttpRequest& req, bool keep) const;
+
+    // fills `res` with the answer of the first handler that has one, false if none has
+    bool processRequest(const std::string& key, HttpRequest& req, HttpResponse& res) {
+        #ifdef TINYHTTP_METRICS
+        auto start = std::chrono::steady_clock::now();
+        #endif
+
+        size_t route = 0;
+        bool found;
+
+        try {
+            found = mRouter.visit(key, [&](const HttpRouter::Handler& h) {
+                res.reset(200);
+                route = h->metricsRoute;
+                return h->process(req, res);
+            }, &req.pathParams());
         } catch (std::exception& e) {
-            std::cerr << "Exception while handling request (" << key << "): " << e.what() << std::endl;
-            return std::make_shared<HttpResponse>(500, "text/plain", "500 exception while processing");
+            TINYHTTP_LOG_ERROR("Exception while handling request (%s): %s", key.c_str(), e.what());
+            res.reset(500);
+            res.setContent("text/plain", "500 exception while processing");
+            found = true;
         }
 
-        return nullptr;
+        #ifdef TINYHTTP_METRICS
+        if (found)
+            HttpMetrics::instance().request(route, req.getMethod(), res.statusCode(), std::chrono::steady_clock::now() - start);
+        else
+            HttpMetrics::instance().notFound();
+        #endif
+
+        return found;
     }
 
-    class Processor : public std::enable_shared_from_this<Processor> {
+    // accepts the next client within the connection limits, -1 if there is none.
+    // Clients over the limits are answered with a 503 and closed here.
+    int openListener(uint16_t port, bool reusePort);
+    // `flags` are passed to accept4
+    int acceptClient(int listener, int flags, HttpConnectionLimits::Slot& slot);
+    // answers with the prebuilt 503 without waiting for the client, and closes
+    void shedClient(int socket, HttpShedReason reason);
+
+    static void registerMetrics(HandlerBuilder& handler, const std::string& route) {
+        #ifdef TINYHTTP_METRICS
+        handler.metricsRoute = HttpMetrics::instance().route(route);
+        #endif
+    }
+
+    // body limit of the handler the request is routed to, see HandlerBuilder::bodyLimit
+    size_t streamingBodyLimit(const std::string& key, const HttpRequest& req) {
+        size_t limit = 0;
+
+        mRouter.visit(key, [&](const HttpRouter::Handler& h) {
+            limit = h->bodyLimit(req);
+            return true;
+        });
+
+        return limit;
+    }
+
+    class Processor : public std::enable_shared_from_this<Processor>, public HttpTimerWheel::Timer {
+        // what the connection waits for, decides which timeout applies
+        enum class Phase : uint8_t {
+            Head,    // a request head, TINYHTTP_HEADER_TIMEOUT
+            Idle,    // the next request or the end of the current one, the idle timeout of the server
+            Handover // messages of another protocol, TINYHTTP_WS_IDLE_TIMEOUT
+        };
+
         std::shared_ptr<IClientStream> mClientStream;
         HttpServer& mOwner;
-        std::chrono::system_clock::time_point mLastActive;
-        bool mIsAlive, mHasHandover;
+        std::atomic<bool> mIsAlive;
+        std::atomic<Phase> mPhase{Phase::Head};
 
         #ifdef TINYHTTP_THREADING
         std::unique_ptr<std::thread> mWorkThread;
         std::mutex mShutdownMutex;
+
+        // place in mRequestProcessors, only used by the timer thread
+        friend class HttpServer;
+        bool mRegistered = false;
+        std::list<std::shared_ptr<Processor>>::iterator mRegistration;
+
+        // worker pool connections wait for their next request in the idle poller, see parkProcessor
+        int mPoolSocket = -1;
+        std::atomic<bool> mParked{false};
+        std::unordered_map<Processor*, std::shared_ptr<Processor>>::node_type mParkingSpot; // reused by every park
         #endif
 
+        // head already parsed by an event loop, served before reading anything else
+        std::unique_ptr<HttpRequest> mPendingRequest;
+        size_t mServed = 0; // responses sent on the connection
+
+        // one request and response object serve the whole connection, their buffers are reused
+        // (pooled connections keep them while they go from worker to worker)
+        HttpRequest mRequest;
+        HttpResponse mResponse{200};
+        OutputQueue mOutput;
+
+            void runHandover(ICanRequestProtocolHandover* handover, std::unique_ptr<HttpRequest> request);
+            // true if the read buffer holds the head of another request
+            bool hasBufferedRequest();
+            // waits for the first bytes of the next request, false if the client closed the connection
+            bool waitForRequest();
+            #ifdef TINYHTTP_THREADING
+            // true for pooled connections that would have to wait for the next request
+            bool waitsForClient();
+            #endif
+            // answers with an error after the queued responses and closes the connection
+            void rejectRequest(OutputQueue& output, const MessageBuilder& message);
+
         public:
-            static void clientThreadProc(std::shared_ptr<Processor> self);
+            // true if a pooled connection stopped to wait for its client, it is still open then
+            static bool clientThreadProc(std::shared_ptr<Processor> self);
 
             Processor(std::shared_ptr<IClientStream> stream, HttpServer& owner);
 
@@ -496,20 +1969,160 @@ class HttpServer {
             inline bool isAlive() const noexcept {
                 return mIsAlive;
             }
-            bool isTimedOut() const noexcept;
+            // when the connection times out unless the client does something
+            HttpTimerWheel::Clock::time_point deadline() const noexcept;
             void shutdown();
 
+            // `served` is the number of responses the connection already got
+            void setPendingRequest(std::unique_ptr<HttpRequest> request, size_t served) noexcept {
+                mPendingRequest = std::move(request);
+                mServed = served;
+            }
+            const std::shared_ptr<IClientStream>& stream() const noexcept { return mClientStream; }
+
             #ifdef TINYHTTP_THREADING
             void startThread();
+            void startHandoverThread(ICanRequestProtocolHandover* handover, std::unique_ptr<HttpRequest> request);
             #endif
     };
 
+    #ifdef TINYHTTP_EPOLL
+    // Serves many non-blocking connections from a single thread, requests are
+    // parsed incrementally as their bytes arrive
+    class EventLoop {
+        struct Connection : HttpTimerWheel::Timer {
+            enum class State { Head, Content };
+
+            int socket = -1;
+            State state = State::Head;
+            StreamBuffer input;
+            HttpRequestParser parser;
+            size_t contentLength = 0;
+            size_t served = 0; // responses sent on the connection
+            char peer[INET6_ADDRSTRLEN] = "-";
+            std::unique_ptr<HttpRequest> request; // reused for every request of the connection
+            HttpResponse response{200};
+            OutputQueue output;
+            HttpConnectionLimits::Slot slot;
+            bool closeAfterWrite = false, peerClosed = false, watchingOutput = false;
+            std::chrono::steady_clock::time_point lastActive;
+            // the head being received has to be complete by then, max() while there is none
+            std::chrono::steady_clock::time_point headDeadline = std::chrono::steady_clock::time_point::max();
+        };
+
+        HttpServer& mOwner;
+        int mEpoll = -1, mWakeFd = -1;
+        int mListener = -1; // a SO_REUSEPORT socket of the loop's own, owned by it
+        int mCpu = -1;
+        std::atomic<bool> mShutdown{false}; // set by stop() from other threads
+        std::unique_ptr<std::thread> mThread;
+        struct Incoming {
+            int socket;
+            HttpConnectionLimits::Slot slot;
+        };
+
+        std::mutex mIncomingMutex;
+        std::vector<Incoming> mIncoming;
+        HttpTimerWheel mTimers; // outlives the connections, they leave it when destroyed
+        std::map<int, std::unique_ptr<Connection>> mConnections;
+
+        void run();
+        void adoptIncoming();
+        void acceptIncoming();
+        void add(int socket, HttpConnectionLimits::Slot slot);
+        void onReadable(Connection& c);
+        bool processInput(Connection& c);
+        bool dispatch(Connection& c);
+        // moves the connection to a blocking stream for a thread of its own,
+        // nullptr if the responses queued so far couldn't be written
+        std::shared_ptr<Processor> detach(Connection& c);
+        bool flush(Connection& c);
+        void watch(Connection& c, bool output);
+        void closeConnection(int socket);
+        // closes the connection if its deadline passed, otherwise arms its timer again
+        void onTimer(Connection& c, std::chrono::steady_clock::time_point now);
+
+        public:
+            // `listener` is accepted from by the loop itself, `cpu` is the one it's pinned to (-1 for none)
+            EventLoop(HttpServer& owner, int listener = -1, int cpu = -1);
+            ~EventLoop();
+
+            void adopt(int socket, HttpConnectionLimits::Slot slot);
+            void stop();
+            void join();
+    };
+
+    unsigned mEventLoopCount = 0;
+    bool mShardedListeners = false;
+    HttpCpuAffinity mCpuAffinity = HttpCpuAffinity::None;
+    std::vector<std::unique_ptr<EventLoop>> mEventLoops;
+
+    void runEventLoops(uint16_t port);
+    #endif
+
     #ifdef TINYHTTP_THREADING
-    void cleanupThreadProc();
+    // a connection to start or stop timing out, see trackProcessor
+    struct ConnectionEvent {
+        std::shared_ptr<Processor> processor;
+        bool finished;
+    };
+
+    void timerThreadProc();
+    void workerThreadProc();
+    // `resumed` connections come back from the idle poller, they are queued even when it is full
+    bool enqueueProcessor(std::shared_ptr<Processor> processor, bool resumed = false);
+    void stopWorkers();
+
+    // Lets a worker go while its connection waits for the client. The idle poller queues the
+    // connection again once it has something to read, false if it has to stay with the worker.
+    bool parkProcessor(const std::shared_ptr<Processor>& processor);
+    // takes a parked connection back and queues it, false if it wasn't parked anymore
+    bool resumeProcessor(Processor* processor);
+    void idlePollerThreadProc();
+
+    // hands connections to the timer thread without taking a lock, it arms a timer for them
+    // and keeps them in mRequestProcessors until they are finished
+    void trackProcessor(std::shared_ptr<Processor> processor) {
+        mTrackedProcessors++;
+        mConnectionEvents.push({std::move(processor), false});
+    }
+
+    // the last use of the server by a connection, the destructor waits for it
+    void untrackProcessor(std::shared_ptr<Processor> processor) {
+        mConnectionEvents.push({std::move(processor), true});
+
+        // only the last connection takes the lock, the destructor can't go on before it's released
+        size_t tracked = mTrackedProcessors.load();
+        while (tracked > 1 && !mTrackedProcessors.compare_exchange_weak(tracked, tracked - 1)) {}
+
+        if (tracked > 1)
+            return;
 
-    std::unique_ptr<std::thread> mCleanupThread;
-    std::list<std::shared_ptr<Processor>> mRequestProcessors;
+        std::unique_lock<std::mutex> lock{mUntrackedMutex};
+        if (--mTrackedProcessors == 0)
+            mAllUntracked.notify_all();
+    }
+
+    std::unique_ptr<std::thread> mTimerThread;
+    HttpEventStack<ConnectionEvent> mConnectionEvents;
+    std::atomic<size_t> mTrackedProcessors{0}; // connections between trackProcessor and untrackProcessor
+    std::mutex mUntrackedMutex;
+    std::condition_variable mAllUntracked; // mTrackedProcessors reached 0
+    std::list<std::shared_ptr<Processor>> mRequestProcessors; // owned by the timer thread, the mutex is for shutdown()
     std::mutex mRequestProcessorListMutex;
+
+    size_t mWorkerCount = 0, mWorkerQueueLength = 0;
+    HttpOverloadPolicy mOverloadPolicy = HttpOverloadPolicy::Reject;
+    std::vector<std::thread> mWorkers;
+    std::deque<std::shared_ptr<Processor>> mWorkerQueue;
+    std::mutex mWorkerQueueMutex;
+    std::condition_variable mWorkerQueueNotEmpty, mWorkerQueueNotFull;
+    bool mWorkersShutdown = false;
+
+    std::unique_ptr<std::thread> mIdlePollerThread;
+    int mIdlePoll = -1, mIdlePollWakeFd = -1;
+    std::unordered_map<Processor*, std::shared_ptr<Processor>> mParkedProcessors;
+    std::mutex mParkedProcessorsMutex;
     #else
     std::shared_ptr<Processor> mCurrentProcessor;
     #endif
@@ -517,32 +2130,98 @@ class HttpServer {
     public:
         HttpServer();
         ~HttpServer() {
-            mCleanupThreadShutdown = true;
             shutdown();
 
+            #ifdef TINYHTTP_EPOLL
+            for (auto& loop : mEventLoops)
+                loop->join();
+            #endif
+
             #ifdef TINYHTTP_THREADING
-            if (mCleanupThread->joinable())
-                mCleanupThread->join();
+            stopWorkers();
+
+            // connection threads report to the timer thread when they finish, it shuts down
+            // the late ones, so both have to outlive every connection
+            {
+                std::unique_lock<std::mutex> lock{mUntrackedMutex};
+                if (!mAllUntracked.wait_for(lock, std::chrono::seconds(TINYHTTP_SHUTDOWN_TIMEOUT), [this]() { return mTrackedProcessors.load() == 0; }))
+                    TINYHTTP_LOG_ERROR("%zu connection threads didn't finish, giving up on them", mTrackedProcessors.load());
+            }
+
+            mTimerThreadShutdown = true;
+            if (mTimerThread->joinable())
+                mTimerThread->join();
             #endif
         }
 
+        #ifdef TINYHTTP_THREADING
+        // Serve connections from a fixed number of worker threads instead of starting a
+        // thread for each of them. Accepted connections wait in a queue of `queueLength`
+        // entries for a free worker, `policy` decides what happens when it is full.
+        // Workers only stay with a connection while it has a request to serve, keep-alive
+        // connections waiting for the next one are watched by a poller thread meanwhile.
+        // 0 workers restores the default mode. Must be called before startListening.
+        void setWorkerPool(size_t workers, size_t queueLength, HttpOverloadPolicy policy = HttpOverloadPolicy::Reject) noexcept {
+            mWorkerCount = workers;
+            mWorkerQueueLength = queueLength;
+            mOverloadPolicy = policy;
+        }
+        #endif
+
+        // Length of the queue of connections the kernel completed but the server didn't
+        // accept yet, capped by net.core.somaxconn. Must be called before startListening.
+        void setListenBacklog(int backlog) noexcept { mListenBacklog = backlog; }
+
+        // Clients connecting while the server has `maxConnections` open, or their address
+        // has `maxPerClient`, get a 503 and are closed. 0 means no limit. Must be called
+        // before startListening.
+        void setConnectionLimits(size_t maxConnections, size_t maxPerClient = 0) noexcept {
+            mLimits.set(maxConnections, maxPerClient);
+        }
+
+        // Close keep-alive connections after `maxRequests` responses, or when they wait longer
+        // than `idleTimeout` seconds for the next request. 0 means no limit. Must be called
+        // before startListening.
+        void setKeepAlive(size_t maxRequests, int idleTimeout = TINYHTTP_CLIENT_TIMEOUT) noexcept {
+            mMaxRequestsPerConnection = maxRequests;
+            mIdleTimeout = idleTimeout;
+        }
+
+        #ifdef TINYHTTP_EPOLL
+        // Serve clients from `count` epoll loops instead of a thread per connection,
+        // 0 restores the default mode. Must be called before startListening.
+        void setEventLoopCount(unsigned count) noexcept { mEventLoopCount = count; }
+
+        // Give every event loop a SO_REUSEPORT listening socket of its own, so the kernel
+        // balances new connections between them and no loop accepts for another. Without
+        // an event loop count, there is one loop per usable CPU. Must be called before
+        // startListening.
+        void setShardedListeners(bool enabled) noexcept { mShardedListeners = enabled; }
+
+        // Pin the event loop threads to CPUs. Must be called before startListening.
+        void setCpuAffinity(HttpCpuAffinity affinity) noexcept { mCpuAffinity = affinity; }
+        #endif
+
         #ifdef TINYHTTP_WS
         std::shared_ptr<WebsockHandlerBuilder> websocket(std::string path) {
             auto h = std::make_shared<WebsockHandlerBuilder>();
-            mHandlers.insert(mHandlers.begin(), std::pair<std::string, std::shared_ptr<WebsockHandlerBuilder>>{std::move(path), h});
+            registerMetrics(*h, path);
+            mRouter.add(std::move(path), h, true);
             return h;
         }
         #endif
 
         std::shared_ptr<HttpHandlerBuilder> when(std::string path) {
             auto h = std::make_shared<HttpHandlerBuilder>();
-            mHandlers.push_back(std::pair<std::string, std::shared_ptr<HttpHandlerBuilder>>{std::move(path), h});
+            registerMetrics(*h, path);
+            mRouter.add(std::move(path), h);
             return h;
         }
 
         std::shared_ptr<HttpHandlerBuilder> whenMatching(std::string path) {
             auto h = std::make_shared<HttpHandlerBuilder>();
-            mReHandlers.push_back(std::pair<std::regex, std::shared_ptr<HttpHandlerBuilder>>{std::regex{std::move(path)}, h});
+            registerMetrics(*h, path);
+            mRouter.addPattern(path, h);
             return h;
         }
 
@@ -199,16 +199,16 @@ namespace base64 {
 }
 
 std::unique_ptr<HttpResponse> WebsockHandlerBuilder::process(const HttpRequest& req) {
-    if (req["Connection"].find("Upgrade") != std::string::npos) {
-        std::string upgrade = req["Upgrade"];
+    if (req.header(HttpHeader::Connection).find("Upgrade") != std::string_view::npos) {
+        std::string_view upgrade = req.header(HttpHeader::Upgrade);
         if (upgrade != "websocket") {
-            fprintf(stderr, "Received connection upgrade with unknown upgrade type: '%s'\n", upgrade.c_str());
+            TINYHTTP_LOG_ERROR("Received connection upgrade with unknown upgrade type: '%.*s'", static_cast<int>(upgrade.size()), upgrade.data());
             return std::make_unique<HttpResponse>(400); // Send "400 Bad request"
         }
 
         HttpResponse res{101};
-        res["Upgrade"] = "WebSocket";
-        res["Connection"] = "Upgrade";
+        res[HttpHeader::Upgrade] = "WebSocket";
+        res[HttpHeader::Connection] = "Upgrade";
 
         auto clientKey = req["Sec-WebSocket-Key"];
         if (!clientKey.empty()) {
@@ -244,7 +244,7 @@ void WebsockHandlerBuilder::acceptHandover(int& serverSock, IClientStream& clien
             realOpc = 0xff;
 
             do {
-                if (client.receive(buffer, 2) == 0) {
+                if (!client.receiveAll(buffer, 2)) {
                     // TODO: this might break non-blocking sockets in the future
                     goto websock_loop_exit;
                 }
@@ -276,10 +276,14 @@ void WebsockHandlerBuilder::acceptHandover(int& serverSock, IClientStream& clien
 
                 size_t payloadLength = second & 0x7F;
                 if (payloadLength == 126) {
-                    client.receive(buffer, 2);
+                    if (!client.receiveAll(buffer, 2))
+                        goto websock_loop_exit;
+
                     payloadLength = ntohs(*reinterpret_cast<uint16_t*>(buffer));
                 } else if (payloadLength == 127) {
-                    client.receive(&payloadLength, 8);
+                    if (!client.receiveAll(&payloadLength, 8))
+                        goto websock_loop_exit;
+
                     payloadLength = be64toh(payloadLength);
 
                     if (payloadLength & (1ull<<63)) {
@@ -290,12 +294,12 @@ void WebsockHandlerBuilder::acceptHandover(int& serverSock, IClientStream& clien
 
                 uint32_t key;
                 if (msk) {
-                    client.receive(&key, 4);
+                    if (!client.receiveAll(&key, 4))
+                        goto websock_loop_exit;
+
                     key = ntohl(key);
                 }
 
-                size_t rl = 0;
-
                 if (totalLength + payloadLength > MAX_ALLOWED_WS_FRAME_LENGTH) {
                     theClient->sendDisconnect();
                     goto websock_loop_exit;
@@ -303,8 +307,8 @@ void WebsockHandlerBuilder::acceptHandover(int& serverSock, IClientStream& clien
 
                 contentBuffer.resize(totalLength + payloadLength);
 
-                while (rl < payloadLength)
-                    rl += client.receive(contentBuffer.data() + totalLength + rl, std::min<size_t>(32768, payloadLength - rl));
+                if (!client.receiveAll(contentBuffer.data() + totalLength, payloadLength))
+                    goto websock_loop_exit;
 
                 if (msk) {
                     for (size_t i = 0, o = 0; i < payloadLength; i++, o = i % 4) {
@@ -315,6 +319,9 @@ void WebsockHandlerBuilder::acceptHandover(int& serverSock, IClientStream& clien
 
                 totalLength += payloadLength;
                 receivingFragment = true;
+
+                // every frame pushes the idle timeout back
+                client.touch();
             } while (!fin);
 
             switch (realOpc) {
@@ -333,7 +340,7 @@ void WebsockHandlerBuilder::acceptHandover(int& serverSock, IClientStream& clien
             }
         }
     } catch (std::exception& e) {
-        std::cerr << "WebSocket closed due to an exception (" << e.what() << ")\n";
+        TINYHTTP_LOG_ERROR("WebSocket closed due to an exception (%s)", e.what());
     }
 
     websock_loop_exit:
@@ -405,7 +412,7 @@ void WebsockClientHandler::sendRaw(uint8_t opcode, const void* data, size_t leng
         try {
             mClient->send(packetBuffer, lengthToSend + headerPosition);
         } catch (std::runtime_error& e) {
-            std::cerr << "WebSocket send failed (" << e.what() << ")" << std::endl;
+            TINYHTTP_LOG_ERROR("WebSocket send failed (%s)", e.what());
             onDisconnect();
             mClient->mErrorFlag = true;
             goto cleanup;